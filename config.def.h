@@ -23,6 +23,69 @@ static Bool pointermonitor = False;
 static Bool deletebs = False;
 static Bool tabcomplete = False;
 
+/*
+ * With -i, keep a case-folded copy of every item (folding non-ASCII
+ * text through the locale too) so matching does not have to fold the
+ * same items on every keystroke. This costs memory for items that
+ * have upper case characters in them.
+ */
+static Bool foldshadow = True;
+
+/*
+ * -I option; index the items by the trigrams (three byte sequences)
+ * they contain, so that tokens of three or more bytes only have to be
+ * checked against items holding all of their trigrams. The index
+ * takes about four bytes per input byte.
+ */
+static Bool trigramindex = False;
+
+/*
+ * -L option; only match as many items as are needed for the current
+ * page, and match the rest when the user pages on or dmenu is idle.
+ */
+static Bool lazymatch = False;
+
+/*
+ * -a option; show the menu at once and read stdin while running, so
+ * items can be selected as they come in.
+ */
+static Bool async = False;
+
+/*
+ * -u option; drop items whose text an earlier item already has, keeping
+ * the first. The input does not have to be sorted.
+ */
+static Bool dedup = False;
+
+/*
+ * -d option; split items into fields at this character, so that -mf,
+ * -df and -pf can pick the fields that are matched, displayed and
+ * printed. Each takes a field number or a range of them like 2-3, 2- or
+ * -3, counting from 1.
+ */
+static const char *delim = NULL;
+static const char *fieldspec[] = { "1-", "1-", "1-" }; /* -mf, -df, -pf */
+
+/*
+ * -H option; a file recording the items chosen and when. Items chosen
+ * before are listed first within each kind of match, those chosen most
+ * often and most recently first.
+ */
+static const char *histfile = NULL;
+
+/*
+ * -c option; a file to keep the items of stdin in, when it is a regular
+ * file. It is made on the first run and mapped as it is on later runs,
+ * until stdin or the options that shape the items change.
+ */
+static const char *itemfile = NULL;
+
+/* bytes of recent match results kept for going back to earlier text */
+static size_t cachesize = 8 << 20;
+
+/* threads used to match large item lists; 0 means one per CPU */
+static int threads = 0;
+
 /*
  * Unitary completion handling: if you have 'one two' and 'on twitch'
  * as options and you enter 'on tw' as your entered text, this
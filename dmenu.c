@@ -1,11 +1,22 @@
 /* See LICENSE file for copyright and license details. */
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <locale.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
+#include <wchar.h>
+#include <wctype.h>
 #include <X11/Xlib.h>
 #include <X11/Xatom.h>
 #include <X11/Xutil.h>
@@ -15,6 +26,8 @@
 #include <X11/Xft/Xft.h>
 
 #include "drw.h"
+#include "rx.h"
+#include "search.h"
 #include "util.h"
 
 /* macros */
@@ -23,32 +36,145 @@
 #define LENGTH(X)             (sizeof X / sizeof X[0])
 #define TEXTNW(X,N)           (drw_font_getexts_width(drw->fonts[0], (X), (N)))
 #define TEXTW(X)              (drw_text(drw, 0, 0, 0, 0, (X), 0) + drw->fonts[0]->h)
+#define SHARDMIN              8192 /* fewest items worth a match worker */
+#define TGBITS                18   /* log2 of the trigram index buckets */
+#define READSIZE              (1 << 16) /* bytes read from stdin at a time */
+#define LAZYCHUNK             4096 /* items scanned at a time by -L */
+#define CACHESIZE             32   /* match results kept for revisiting */
+#define FUZZYPAGES            4    /* pages of fuzzy matches ranked at first */
+#define HISTSLACK             64   /* history records kept beyond two per entry */
+#define NOFOLD                UINT32_MAX
+#define NOITEM                UINT32_MAX
+#define TEXTOF(I)             (textbuf + items[I].off)
+#define ALIGN8(N)             (((N) + 7) & ~(size_t)7)
+#define ITEMMAGIC             "dmenu\0\0\5" /* item file format, version 5 */
+#define ITEMFLAGS             (icase | shadow << 1 | dedup << 2 | trigramindex << 3)
+#define FOLDBYTE(C)           ((icase && (C) >= 'A' && (C) <= 'Z') ? (C) | 0x20 : (C))
 
 /* enums */
 enum { SchemeNorm, SchemeSel, SchemeOut, SchemeLast }; /* color schemes */
+enum { TierExact, TierPrefix, TierSubstr, TierLast }; /* match tiers */
 
-typedef struct Item Item;
-struct Item {
-	char *text;
-	Item *left, *right;
-	Bool out;
-	Bool hidden;	/* item is not displayed unless autocomplete matches it */
-};
+enum { ItemOut = 1 }; /* item flags */
+enum { FieldMatch, FieldShow, FieldPrint, FieldLast }; /* item fields */
 
-static void appenditem(Item *item, Item **list, Item **last);
+typedef struct {
+	uint32_t off, len;	/* text in textbuf */
+	uint32_t foff, flen;	/* case-folded text for -i in folds, or NOFOLD */
+} Item;
+
+typedef struct {
+	uint32_t off, len;	/* part of an item in textbuf */
+} Field;
+
+typedef struct {
+	char *buf;
+	size_t len, cap;
+} Arena;
+
+/* an item file for -c is this header, then the item texts, the items,
+   their flags, their fields for -d, the folded texts and the trigram
+   index, each padded to a multiple of 8 bytes */
+typedef struct {
+	char magic[8];
+	uint64_t dev, ino, size, mtime, mtimensec, start;	/* where the items came from */
+	uint32_t flags, nitems, widest, tgbits;
+	uint32_t delim, fieldlo[FieldLast], fieldhi[FieldLast], nvisible;
+	uint64_t textlen, foldlen, npost;
+	uint64_t bytefreq[256];
+} ItemFile;
+
+typedef struct {
+	char *key;	/* tokens as matched, joined by spaces */
+	int flags;
+	uint32_t *idx;	/* the matches, tier after tier */
+	size_t ntier[TierLast];
+	size_t size;
+	unsigned long used;
+} Result;
+
+typedef struct {
+	int score;
+	uint32_t idx;
+} Hit;
+
+typedef struct {
+	const char *text;	/* in the mapped history file, or a copy */
+	uint32_t len;
+	unsigned long count, last;	/* times chosen, and when last */
+} Hist;
+
+typedef struct {
+	uint32_t *cand;	/* candidates to scan, or NULL to scan items */
+	size_t start, end;
+	int tiers;	/* mask of the tiers to collect */
+	uint32_t *found[TierLast];	/* the matches of each tier */
+	size_t nfound[TierLast], foundcap[TierLast];
+	Hit *hits;	/* -F: heap of the best fuzzyk matches, worst on top */
+	size_t nhits, nmatch;
+} Shard;
+
+typedef struct {
+	uint32_t item;	/* the item drawn on a line of the list, or NOITEM */
+	int scheme;
+} Row;
+
+static void additem(const char *s, uint32_t off, size_t len, Bool hidden);
+static size_t addlines(const char *buf, size_t start, size_t end, Bool last);
+static void appenditem(Shard *sh, int t, uint32_t i);
+static void appendtier(Shard *sh, int t);
+static char *arenagrow(Arena *a, size_t n);
+static void buildtrigrams(void);
+static void cacheclear(void);
+static Bool cacheget(void);
+static void cacheput(void);
 static void calcoffsets(void);
-static char *cistrstr(const char *s, const char *sub);
 static void cleanup(void);
 static void drawmenu(void);
+static Bool dupitem(const char *s, size_t len);
+static int fuzzyscore(const char *s, size_t len, const char *tok, size_t toklen);
+static void fuzzyshard(Shard *sh);
+static const char *fieldtext(uint32_t i, int f, size_t *len);
+static size_t foldcase(char *dst, size_t size, const char *s, size_t len);
 static void grabkeyboard(void);
+static void histadd(uint32_t i);
+static Hist *histfind(const char *s, size_t len, Bool add);
+static void histload(void);
+static int histscore(const Hist *h);
+static int hitcmp(const void *a, const void *b);
+static int idxcmp(const void *a, const void *b);
 static void insert(const char *str, ssize_t n);
+static int itemwidth(uint32_t i);
 static void keypress(XKeyEvent *ev);
+static Bool loaditems(void);
+static char *mapstdin(size_t *start, size_t *size);
 static void match(void);
+static void matchfuzzy(size_t from);
+static void matchdone(void);
+static Bool matchmore(void);
+static void matchnew(size_t from);
+static void matchshard(Shard *sh);
+static const char *matchtext(uint32_t i, size_t *len);
+static void *matchworker(void *arg);
+static size_t mergetiers(uint32_t *cand);
 static size_t nextrune(int inc);
+static void parsefields(void);
 static void paste(void);
+static void poolinit(void);
+static void poolrun(size_t k);
+static void rankitems(void);
+static Bool readblock(void);
 static void readstdin(void);
+static void readstream(void);
 static void run(void);
+static void saveitems(const char *text, size_t textlen);
 static void setup(void);
+static const char *showtext(uint32_t i);
+static void splitfield(const char *s, uint32_t off, size_t len, int f);
+static uint32_t strhash(const char *s, size_t len);
+static unsigned int tghash(const char *s);
+static size_t tokfreq(const char *s, size_t len);
+static Bool trigramcands(uint32_t *cand, size_t *n);
 static void usage(void);
 
 static Bool setcommonpref(Bool again);
@@ -57,10 +183,39 @@ static char text[BUFSIZ] = "";
 static int bh, mw, mh;
 static int inputw, promptw;
 static size_t cursor = 0;
+static Bool icase = False;
+static Bool stats = False;
+static Bool reading = False;	/* -a: stdin is still coming in */
+static Bool fuzzy = False;
+static size_t fuzzyk, nfuzzy;	/* fuzzy matches ranked and found */
+static Bool regex = False;
+static Rx *rx;	/* the text compiled for -r, or NULL if malformed */
+static const int rxtier[] = { TierExact, TierPrefix, TierSubstr, TierLast };
 static Atom clip, utf8;
 static Item *items = NULL;
-static Item *matches, *matchend;
-static Item *prev, *curr, *next, *sel;
+static unsigned char *itemflags = NULL;
+static Field *fields = NULL;	/* -d: FieldLast fields per item */
+static unsigned int fieldlo[FieldLast], fieldhi[FieldLast];
+static size_t delimlen;	/* -d: bytes of the first character of delim */
+static uint32_t delimcode;	/* and those bytes as a number */
+static size_t nitems = 0;
+static size_t nvisible = 0;	/* items before the first blank line */
+static Bool mapped = False;	/* items are in a mapped item file */
+static unsigned int *itemw = NULL;	/* item widths as drawn, or 0 */
+static size_t itemwcap = 0;
+static Fnt *itemwfont = NULL;	/* the font they were measured in */
+static char *textbuf;	/* the item texts: texts.buf, or stdin mapped */
+static Arena texts, folds;	/* texts read from a pipe, folded texts */
+static size_t widest = 0;	/* the longest item */
+static uint32_t *dupset = NULL;	/* -u: open hash set of item indices + 1 */
+static size_t dupcap = 0, ndups = 0;
+static size_t bytefreq[256];	/* number of items containing each byte */
+static uint32_t *matches = NULL;	/* the matching items, tier after tier */
+static size_t nmatches = 0, ntier[TierLast];
+static size_t prev, curr, next, sel;	/* positions in matches */
+static Row *rows = NULL;	/* -l: the list as last drawn, or NULL */
+static char drawntext[sizeof text];	/* the input as last drawn */
+static size_t drawncursor;
 static Window win;
 static XIC xic;
 static int mon = -1;
@@ -75,7 +230,48 @@ static int sw, sh; /* X display screen geometry width, height */
 #include "config.h"
 
 static int (*fstrncmp)(const char *, const char *, size_t) = strncmp;
-static char *(*fstrstr)(const char *, const char *) = strstr;
+static char *(*fstrstr)(const char *, size_t, const char *, size_t) = memfind;
+
+/* the current query, shared with the match workers */
+static char **tokv = NULL;
+static size_t *tokl = NULL;
+static int *tokord = NULL;	/* tokens in the order they are tried */
+static int tokc = 0;
+static Bool shadow;
+static int (*tokcmp)(const char *, const char *, size_t);
+static char *(*tokfind)(const char *, size_t, const char *, size_t);
+
+/* match worker pool */
+static Shard *shards = NULL;
+static int nworkers = 0;
+static size_t poolused;
+static int poolbusy;
+static unsigned long poolgen = 0;
+static pthread_mutex_t poollock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t poolwake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pooldone = PTHREAD_COND_INITIALIZER;
+
+/* the part of the scan -L has left for later */
+static Shard rest;
+static char lasttext[sizeof text];
+static char matchkey[2 * sizeof text];
+
+/* recent match results, to restore when text is edited back */
+static Result cache[CACHESIZE];
+static size_t cachebytes = 0;
+static unsigned long cacheclock = 0, cachehits = 0, cachemisses = 0;
+
+/* -H: the items chosen before, by text */
+static Hist *hist = NULL;
+static size_t nhist = 0, nhistrec = 0;	/* entries, and records in the file */
+static uint32_t *histset = NULL;	/* open hash set of entries + 1 */
+static size_t histcap = 0;
+static Bool histtorn = False;	/* the last record was cut short */
+
+/* trigram index: the items holding trigrams that hash to bucket b are
+   tgpost[tgstart[b]] to tgpost[tgstart[b+1]-1], in input order */
+static uint32_t *tgstart = NULL;
+static uint32_t *tgpost = NULL;
 
 int
 main(int argc, char *argv[]) {
@@ -94,7 +290,8 @@ main(int argc, char *argv[]) {
 			fast = True;
 		else if(!strcmp(argv[i], "-i")) { /* case-insensitive item matching */
 			fstrncmp = strncasecmp;
-			fstrstr = cistrstr;
+			fstrstr = memifind;
+			icase = True;
 		}
 		else if(!strcmp(argv[i], "-db"))  /* delete magic setting */
 			deletebs = True;
@@ -104,6 +301,20 @@ main(int argc, char *argv[]) {
 			tabcomplete = True;
 		else if(!strcmp(argv[i], "-U"))   /* 'unitary' token handling */
 			unitary = True;
+		else if(!strcmp(argv[i], "-I"))   /* index items by trigrams */
+			trigramindex = True;
+		else if(!strcmp(argv[i], "-S"))   /* print statistics to stderr */
+			stats = True;
+		else if(!strcmp(argv[i], "-L"))   /* match only as far as displayed */
+			lazymatch = True;
+		else if(!strcmp(argv[i], "-F"))   /* fuzzy matching */
+			fuzzy = True;
+		else if(!strcmp(argv[i], "-a"))   /* read stdin while running */
+			async = True;
+		else if(!strcmp(argv[i], "-u"))   /* drop duplicate items */
+			dedup = True;
+		else if(!strcmp(argv[i], "-r"))   /* regular expression matching */
+			regex = True;
 		else if(i+1 == argc)
 			usage();
 		/* these options take one argument */
@@ -111,6 +322,18 @@ main(int argc, char *argv[]) {
 			lines = atoi(argv[++i]);
 		else if(!strcmp(argv[i], "-m"))
 			mon = atoi(argv[++i]);
+		else if(!strcmp(argv[i], "-d"))   /* field delimiter */
+			delim = argv[++i];
+		else if(!strcmp(argv[i], "-mf"))  /* fields matched */
+			fieldspec[FieldMatch] = argv[++i];
+		else if(!strcmp(argv[i], "-df"))  /* fields displayed */
+			fieldspec[FieldShow] = argv[++i];
+		else if(!strcmp(argv[i], "-pf"))  /* fields printed */
+			fieldspec[FieldPrint] = argv[++i];
+		else if(!strcmp(argv[i], "-H"))   /* history of chosen items */
+			histfile = argv[++i];
+		else if(!strcmp(argv[i], "-c"))   /* item file kept for stdin */
+			itemfile = argv[++i];
 		else if(!strcmp(argv[i], "-p"))   /* adds prompt to left of input field */
 			prompt = argv[++i];
 		else if(!strcmp(argv[i], "-fn"))  /* font or font set */
@@ -126,6 +349,13 @@ main(int argc, char *argv[]) {
 		else
 			usage();
 
+	if(delim && !*delim)
+		delim = NULL;
+	/* -r overrides -F, whichever comes first */
+	if(regex)
+		fuzzy = False;
+	parsefields();
+	searchinit();
 	if(!setlocale(LC_CTYPE, "") || !XSupportsLocale())
 		fputs("warning: no locale support\n", stderr);
 	if(!(dpy = XOpenDisplay(NULL)))
@@ -155,15 +385,238 @@ main(int argc, char *argv[]) {
 }
 
 void
-appenditem(Item *item, Item **list, Item **last) {
-	if(*last)
-		(*last)->right = item;
-	else
-		*list = item;
+additem(const char *s, uint32_t off, size_t len, Bool hidden) {
+	static size_t cap = 0, seen[256];
+	const char *p = s;
+	char *f;
+	size_t i, flen, plen = len;
+	unsigned char c;
+	int k;
+
+	/* the item list, and room for matching all of it, doubles as it fills */
+	if(nitems == cap) {
+		cap = cap ? cap * 2 : BUFSIZ / sizeof *items;
+		if(!(items = realloc(items, cap * sizeof *items))
+		|| !(itemflags = realloc(itemflags, cap))
+		|| !(matches = realloc(matches, cap * sizeof *matches))
+		|| (delim && !(fields = realloc(fields, cap * FieldLast * sizeof *fields))))
+			die("cannot realloc %u bytes:", cap * sizeof *items);
+	}
+	items[nitems].off = off;
+	items[nitems].len = len;
+	items[nitems].foff = NOFOLD;
+	items[nitems].flen = 0;
+	itemflags[nitems] = 0;
+	/* items are hidden from the first blank line on, so the visible
+	   items come first and empty text only has to look at those */
+	if(!hidden)
+		nvisible = nitems + 1;
+	/* with -d, only the fields picked by -mf are matched */
+	if(delim) {
+		for(k = 0; k < FieldLast; k++)
+			splitfield(s, off, len, k);
+		p = s + (fields[nitems * FieldLast + FieldMatch].off - off);
+		plen = fields[nitems * FieldLast + FieldMatch].len;
+	}
+	if(shadow) {
+		/* fold into the end of the arena and keep it only if folding
+		   changed something; otherwise the text is shared */
+		f = arenagrow(&folds, 2 * plen + 1);
+		flen = foldcase(f, 2 * plen + 1, p, plen);
+		if(flen != plen || memcmp(f, p, plen)) {
+			items[nitems].foff = folds.len;
+			items[nitems].flen = flen;
+			folds.len += flen + 1;
+			p = f;
+			plen = flen;
+		}
+	}
+	for(i = 0; i < plen; i++)
+		if(seen[(c = FOLDBYTE((unsigned char)p[i]))] != nitems + 1) {
+			seen[c] = nitems + 1;
+			bytefreq[c]++;
+		}
+	nitems++;
+}
+
+size_t
+addlines(const char *buf, size_t start, size_t end, Bool last) {
+	static Bool hidden = False;
+	const char *p, *q;
+	size_t len, w, max;
+
+	/* add the lines in buf from start to end as items, in place. a
+	   line without a newline is left for next time unless it is the
+	   last. */
+	for(p = &buf[start]; p < &buf[end]; p = q + 1) {
+		if(!(q = memchr(p, '\n', &buf[end] - p))) {
+			if(!last)
+				break;
+			q = &buf[end];
+		}
+		len = q - p;
+		/* blank line == start hiding items from normal display */
+		if(!len) {
+			hidden = True;
+			continue;
+		}
+		if(dedup && dupitem(p, len)) {
+			ndups++;
+			continue;
+		}
+		additem(p, p - buf, len, hidden);
+		fieldtext(widest, FieldShow, &max);
+		fieldtext(nitems - 1, FieldShow, &w);
+		if(w > max)
+			widest = nitems - 1;
+	}
+	return MIN((size_t)(p - buf), end);
+}
+
+void
+appenditem(Shard *sh, int t, uint32_t i) {
+	if(sh->nfound[t] == sh->foundcap[t]) {
+		sh->foundcap[t] = sh->foundcap[t] ? sh->foundcap[t] * 2 : BUFSIZ;
+		if(!(sh->found[t] = realloc(sh->found[t], sh->foundcap[t] * sizeof *sh->found[t])))
+			die("cannot realloc %u bytes:", sh->foundcap[t] * sizeof *sh->found[t]);
+	}
+	sh->found[t][sh->nfound[t]++] = i;
+}
+
+void
+appendtier(Shard *sh, int t) {
+	if(!sh->nfound[t])
+		return;
+	memcpy(&matches[nmatches], sh->found[t], sh->nfound[t] * sizeof *matches);
+	nmatches += sh->nfound[t];
+	ntier[t] += sh->nfound[t];
+}
+
+char *
+arenagrow(Arena *a, size_t n) {
+	/* make room for n more bytes. the buffer doubles as it fills,
+	   and stays small enough for items to be 32-bit offsets into it */
+	if(a->len + n > a->cap) {
+		if(a->len + n > NOFOLD)
+			die("too much input\n");
+		a->cap = MIN(MAX(MAX(a->cap * 2, a->len + n), BUFSIZ), NOFOLD);
+		if(!(a->buf = realloc(a->buf, a->cap)))
+			die("cannot realloc %u bytes:", a->cap);
+	}
+	return &a->buf[a->len];
+}
 
-	item->left = *last;
-	item->right = NULL;
-	*last = item;
+void
+buildtrigrams(void) {
+	struct timespec t0, t1;
+	uint32_t *last;
+	size_t i, j, len, b, nb = (size_t)1 << TGBITS, pass;
+	const char *s;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	if(!(tgstart = calloc(nb + 1, sizeof *tgstart)) || !(last = calloc(nb, sizeof *last)))
+		die("cannot malloc %u bytes:", (nb + 1) * sizeof *tgstart);
+	/* count the items in each bucket, then fill them in, both times
+	   entering an item at most once per bucket */
+	for(pass = 0; pass < 2; pass++) {
+		for(i = 0; i < nitems; i++) {
+			s = matchtext(i, &len);
+			for(j = 0; j + 3 <= len; j++) {
+				if(last[(b = tghash(&s[j]))] == i + 1)
+					continue;
+				last[b] = i + 1;
+				if(pass)
+					tgpost[tgstart[b + 1]++] = i;
+				else
+					tgstart[b + 1]++;
+			}
+		}
+		if(pass)
+			break;
+		for(b = 0; b < nb; b++) {
+			tgstart[b + 1] += tgstart[b];
+			last[b] = 0;
+		}
+		if(!(tgpost = malloc(MAX(tgstart[nb], 1) * sizeof *tgpost)))
+			die("cannot malloc %u bytes:", tgstart[nb] * sizeof *tgpost);
+		/* fill from the start of each bucket; the filling moves
+		   tgstart[b+1] there, which is where it was */
+		memmove(&tgstart[1], &tgstart[0], nb * sizeof *tgstart);
+	}
+	free(last);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	if(stats)
+		fprintf(stderr, "dmenu: trigram index: %lu postings, %lu KB, %.1f ms\n",
+		        (unsigned long)tgstart[nb],
+		        (unsigned long)((nb + 1 + tgstart[nb]) * sizeof *tgpost / 1024),
+		        (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6);
+}
+
+void
+cacheclear(void) {
+	Result *r;
+
+	for(r = cache; r < cache + CACHESIZE; r++)
+		if(r->key) {
+			free(r->key);
+			free(r->idx);
+			r->key = NULL;
+		}
+	cachebytes = 0;
+}
+
+Bool
+cacheget(void) {
+	Result *r;
+	size_t k;
+	int t;
+
+	for(r = cache; r < cache + CACHESIZE; r++)
+		if(r->key && r->flags == (icase | unitary << 1 | regex << 2) && !strcmp(r->key, matchkey))
+			break;
+	if(r == cache + CACHESIZE) {
+		cachemisses++;
+		return False;
+	}
+	cachehits++;
+	r->used = ++cacheclock;
+	for(t = k = 0; t < TierLast; t++)
+		k += (ntier[t] = r->ntier[t]);
+	memcpy(matches, r->idx, k * sizeof *matches);
+	nmatches = k;
+	return True;
+}
+
+void
+cacheput(void) {
+	Result *r, *slot, *lru;
+	size_t size;
+
+	size = nmatches * sizeof *r->idx + strlen(matchkey) + 1;
+	if(size > cachesize / 2)
+		return;
+	/* drop the least recently used results until there is room */
+	for(;;) {
+		for(slot = lru = NULL, r = cache; r < cache + CACHESIZE; r++)
+			if(!r->key)
+				slot = slot ? slot : r;
+			else if(!lru || r->used < lru->used)
+				lru = r;
+		if(slot && cachebytes + size <= cachesize)
+			break;
+		cachebytes -= lru->size;
+		free(lru->key);
+		free(lru->idx);
+		lru->key = NULL;
+	}
+	if(!(slot->key = strdup(matchkey)) || !(slot->idx = malloc(MAX(nmatches, 1) * sizeof *slot->idx)))
+		die("cannot malloc %u bytes:", size);
+	memcpy(slot->idx, matches, nmatches * sizeof *matches);
+	memcpy(slot->ntier, ntier, sizeof ntier);
+	slot->flags = icase | unitary << 1 | regex << 2;
+	slot->size = size;
+	slot->used = ++cacheclock;
+	cachebytes += size;
 }
 
 void
@@ -175,11 +628,14 @@ calcoffsets(void) {
 	else
 		n = mw - (promptw + inputw + TEXTW("<") + TEXTW(">"));
 	/* calculate which items will begin the next page and previous page */
-	for(i = 0, next = curr; next; next = next->right)
-		if((i += (lines > 0) ? bh : MIN(TEXTW(next->text), n)) > n)
+	for(i = 0, next = curr; next < nmatches; next++) {
+		if((i += (lines > 0) ? bh : MIN(itemwidth(matches[next]), n)) > n)
 			break;
-	for(i = 0, prev = curr; prev && prev->left; prev = prev->left)
-		if((i += (lines > 0) ? bh : MIN(TEXTW(prev->left->text), n)) > n)
+		while(next + 1 == nmatches && matchmore())
+			;
+	}
+	for(i = 0, prev = curr; prev > 0; prev--)
+		if((i += (lines > 0) ? bh : MIN(itemwidth(matches[prev-1]), n)) > n)
 			break;
 }
 
@@ -195,85 +651,278 @@ cleanup(void) {
 	drw_free(drw);
 	XSync(dpy, False);
 	XCloseDisplay(dpy);
-}
-
-char *
-cistrstr(const char *s, const char *sub) {
-	size_t len;
-
-	for(len = strlen(sub); *s; s++)
-		if(!strncasecmp(s, sub, len))
-			return (char *)s;
-	return NULL;
+	if(stats && dedup)
+		fprintf(stderr, "dmenu: %lu duplicate items dropped\n", (unsigned long)ndups);
+	if(stats)
+		fprintf(stderr, "dmenu: match cache: %lu hits, %lu misses, %lu KB\n",
+		        cachehits, cachemisses, (unsigned long)(cachebytes / 1024));
 }
 
 void
 drawmenu(void) {
-	int curpos;
-	Item *item;
+	int curpos, r, s;
+	size_t i;
 	int x = 0, y = 0, h = bh, w;
+	int y0 = mh, y1 = 0;	/* the lines drawn this time */
+	Bool all;
+	uint32_t item;
 
-	drw_setscheme(drw, &scheme[SchemeNorm]);
-	drw_rect(drw, 0, 0, mw, mh, True, 1, 1);
+	/* the vertical list keeps what it drew last time, and only the input
+	   and the lines that changed since are drawn and copied to the window.
+	   moving the selection redraws two lines. */
+	if((all = lines <= 0 || !rows)) {
+		drw_setscheme(drw, &scheme[SchemeNorm]);
+		drw_rect(drw, 0, 0, mw, mh, True, 1, 1);
+	}
 
 	if(prompt && *prompt) {
-		drw_setscheme(drw, &scheme[SchemeSel]);
-		drw_text(drw, x, 0, promptw, bh, prompt, 0);
+		if(all) {
+			drw_setscheme(drw, &scheme[SchemeSel]);
+			drw_text(drw, x, 0, promptw, bh, prompt, 0);
+		}
 		x += promptw;
 	}
 	/* draw input field */
-	w = (lines > 0 || !matches) ? mw - x : inputw;
-	drw_setscheme(drw, &scheme[SchemeNorm]);
-	drw_text(drw, x, 0, w, bh, text, 0);
-
-	if((curpos = TEXTNW(text, cursor) + bh/2 - 2) < w) {
+	w = (lines > 0 || !nmatches) ? mw - x : inputw;
+	if(all || cursor != drawncursor || strcmp(text, drawntext)) {
 		drw_setscheme(drw, &scheme[SchemeNorm]);
-		drw_rect(drw, x + curpos + 2, 2, 1, bh - 4, 1, 1, 0);
+		drw_text(drw, x, 0, w, bh, text, 0);
+
+		if((curpos = TEXTNW(text, cursor) + bh/2 - 2) < w) {
+			drw_setscheme(drw, &scheme[SchemeNorm]);
+			drw_rect(drw, x + curpos + 2, 2, 1, bh - 4, 1, 1, 0);
+		}
+		strcpy(drawntext, text);
+		drawncursor = cursor;
+		y0 = 0;
+		y1 = bh;
 	}
 
 	if(lines > 0) {
 		/* draw vertical list */
+		if(!rows && !(rows = malloc(lines * sizeof *rows)))
+			die("cannot malloc %u bytes:", lines * sizeof *rows);
 		w = mw - x;
-		for(item = curr; item != next; item = item->right) {
+		for(r = 0, i = curr; r < lines; r++, i++) {
 			y += h;
-			if(item == sel)
-				drw_setscheme(drw, &scheme[SchemeSel]);
-			else if(item->out)
-				drw_setscheme(drw, &scheme[SchemeOut]);
-			else
-				drw_setscheme(drw, &scheme[SchemeNorm]);
+			if(i >= next) {
+				item = NOITEM;
+				s = SchemeNorm;
+			} else {
+				item = matches[i];
+				if(i == sel)
+					s = SchemeSel;
+				else if(itemflags[item] & ItemOut)
+					s = SchemeOut;
+				else
+					s = SchemeNorm;
+			}
+			if(!all && rows[r].item == item && rows[r].scheme == s)
+				continue;
+			rows[r].item = item;
+			rows[r].scheme = s;
 
-			drw_text(drw, x, y, w, bh, item->text, 0);
+			drw_setscheme(drw, &scheme[s]);
+			if(item == NOITEM)
+				drw_rect(drw, x, y, w, bh, True, 1, 1);
+			else
+				drw_text(drw, x, y, w, bh, showtext(item), 0);
+			y0 = MIN(y0, y);
+			y1 = MAX(y1, y + bh);
 		}
 	}
-	else if(matches) {
+	else if(nmatches) {
 		/* draw horizontal list */
 		x += inputw;
 		w = TEXTW("<");
-		if(curr->left) {
+		if(curr > 0) {
 			drw_setscheme(drw, &scheme[SchemeNorm]);
 			drw_text(drw, x, 0, w, bh, "<", 0);
 		}
-		for(item = curr; item != next; item = item->right) {
+		for(i = curr; i < next; i++) {
 			x += w;
-			w = MIN(TEXTW(item->text), mw - x - TEXTW(">"));
+			w = MIN(itemwidth(matches[i]), mw - x - TEXTW(">"));
 
-			if(item == sel)
+			if(i == sel)
 				drw_setscheme(drw, &scheme[SchemeSel]);
-			else if(item->out)
+			else if(itemflags[matches[i]] & ItemOut)
 				drw_setscheme(drw, &scheme[SchemeOut]);
 			else
 				drw_setscheme(drw, &scheme[SchemeNorm]);
-			drw_text(drw, x, 0, w, bh, item->text, 0);
+			drw_text(drw, x, 0, w, bh, showtext(matches[i]), 0);
 		}
 		w = TEXTW(">");
 		x = mw - w;
-		if(next) {
+		if(next < nmatches) {
 			drw_setscheme(drw, &scheme[SchemeNorm]);
 			drw_text(drw, x, 0, w, bh, ">", 0);
 		}
 	}
-	drw_map(drw, win, 0, 0, mw, mh);
+	if(all)
+		drw_map(drw, win, 0, 0, mw, mh);
+	else if(y0 < y1)
+		drw_map(drw, win, 0, y0, mw, y1 - y0);
+}
+
+const char *
+fieldtext(uint32_t i, int f, size_t *len) {
+	/* the fields of item i that f picks, or all of it without -d */
+	if(!fields) {
+		*len = items[i].len;
+		return TEXTOF(i);
+	}
+	*len = fields[i * FieldLast + f].len;
+	return textbuf + fields[i * FieldLast + f].off;
+}
+
+size_t
+foldcase(char *dst, size_t size, const char *s, size_t len) {
+	char mb[MB_LEN_MAX];
+	mbstate_t ps;
+	wchar_t wc;
+	size_t i, j, n, m;
+
+	/* lower-case s into dst; ASCII is done directly, anything else
+	   goes through the locale, and invalid bytes are copied as is */
+	memset(&ps, 0, sizeof ps);
+	for(i = j = 0; i < len; i += n) {
+		if(!(s[i] & 0x80)) {
+			mb[0] = (s[i] >= 'A' && s[i] <= 'Z') ? s[i] | 0x20 : s[i];
+			n = m = 1;
+		}
+		else if((n = mbrtowc(&wc, &s[i], len - i, &ps)) == (size_t)-1
+		        || n == (size_t)-2 || n == 0
+		        || (m = wcrtomb(mb, towlower(wc), &ps)) == (size_t)-1) {
+			memset(&ps, 0, sizeof ps);
+			mb[0] = s[i];
+			n = m = 1;
+		}
+		if(j + m >= size)
+			break;
+		memcpy(&dst[j], mb, m);
+		j += m;
+	}
+	dst[j] = '\0';
+	return j;
+}
+
+Bool
+dupitem(const char *s, size_t len) {
+	size_t i, j, h, mask;
+	uint32_t *old;
+
+	/* keep the set at most half full, so probes stay short. it holds
+	   items by index, and their text is hashed again when it grows. */
+	if(2 * (nitems + 1) > dupcap) {
+		old = dupset;
+		j = dupcap;
+		dupcap = dupcap ? dupcap * 2 : 1024;
+		if(!(dupset = calloc(dupcap, sizeof *dupset)))
+			die("cannot malloc %u bytes:", dupcap * sizeof *dupset);
+		for(mask = dupcap - 1; j-- > 0; ) {
+			if(!old[j])
+				continue;
+			for(h = strhash(TEXTOF(old[j] - 1), items[old[j] - 1].len) & mask;
+			    dupset[h]; h = (h + 1) & mask)
+				;
+			dupset[h] = old[j];
+		}
+		free(old);
+	}
+	/* an item is a duplicate if some earlier item has the same text.
+	   else it is about to be added as item nitems. */
+	mask = dupcap - 1;
+	for(h = strhash(s, len) & mask; (i = dupset[h]); h = (h + 1) & mask)
+		if(items[i-1].len == len && !memcmp(TEXTOF(i-1), s, len))
+			return True;
+	dupset[h] = nitems + 1;
+	return False;
+}
+
+int
+fuzzyscore(const char *s, size_t len, const char *tok, size_t toklen) {
+	const char *p;
+	size_t i, j, start, end;
+	int score = 0, run = 0;
+
+	/* find where the first occurrence of tok as a subsequence ends,
+	   skipping ahead with memchr() when no folding is needed */
+	for(i = j = 0; j < toklen; i++, j++) {
+		if(!icase || shadow) {
+			if(!(p = memchr(&s[i], tok[j], len - i)))
+				return -1;
+			i = p - s;
+		}
+		else
+			for(; i < len && FOLDBYTE((unsigned char)s[i]) != FOLDBYTE((unsigned char)tok[j]); i++)
+				;
+		if(i == len)
+			return -1;
+	}
+	/* then walk back to the shortest occurrence ending there */
+	for(end = i, j = toklen; j > 0; i--)
+		if(FOLDBYTE((unsigned char)s[i-1]) == FOLDBYTE((unsigned char)tok[j-1]))
+			j--;
+	start = i;
+	/* reward runs, word starts and a match at the start; punish gaps */
+	for(i = start, j = 0; i < end; i++) {
+		if(FOLDBYTE((unsigned char)s[i]) == FOLDBYTE((unsigned char)tok[j])) {
+			score += 16 + 8 * run;
+			if(i == 0 || !isalnum((unsigned char)s[i-1]))
+				score += 8;
+			run++;
+			j++;
+		}
+		else {
+			score -= run ? 3 : 1;
+			run = 0;
+		}
+	}
+	return score + (start == 0 ? 16 : 0);
+}
+
+void
+fuzzyshard(Shard *sh) {
+	size_t i, p, c, len;
+	int j, score, sc;
+	uint32_t idx;
+	const char *s;
+	Hit h;
+
+	sh->nhits = sh->nmatch = 0;
+	for(i = sh->start; i < sh->end; i++) {
+		idx = sh->cand ? sh->cand[i] : i;
+		s = matchtext(idx, &len);
+		for(score = j = 0; j < tokc; j++) {
+			if((sc = fuzzyscore(s, len, tokv[tokord[j]], tokl[tokord[j]])) < 0)
+				break;
+			score += sc;
+		}
+		if(j < tokc)
+			continue;
+		sh->nmatch++;
+		h.score = score;
+		h.idx = idx;
+		if(sh->nhits == fuzzyk) {
+			/* only replace the worst hit with a better one */
+			if(hitcmp(&h, &sh->hits[0]) > 0)
+				continue;
+			p = 0;
+		}
+		else
+			p = sh->nhits++;
+		/* move h up or down the heap to where it belongs */
+		for(; p > 0 && hitcmp(&h, &sh->hits[(p - 1) / 2]) > 0; p = (p - 1) / 2)
+			sh->hits[p] = sh->hits[(p - 1) / 2];
+		for(; (c = 2 * p + 1) < sh->nhits; p = c) {
+			if(c + 1 < sh->nhits && hitcmp(&sh->hits[c + 1], &sh->hits[c]) > 0)
+				c++;
+			if(hitcmp(&sh->hits[c], &h) <= 0)
+				break;
+			sh->hits[p] = sh->hits[c];
+		}
+		sh->hits[p] = h;
+	}
 }
 
 void
@@ -290,6 +939,161 @@ grabkeyboard(void) {
 	die("cannot grab keyboard\n");
 }
 
+void
+histadd(uint32_t i) {
+	Hist *h;
+	FILE *fp;
+	char *tmp, *s;
+	size_t j;
+	int fd;
+
+	/* chosen once more now. the file is a log of such records, which
+	   is written again with one per entry when most are repeats. a
+	   new entry keeps a copy of the text, since -a may move items. */
+	h = histfind(TEXTOF(i), items[i].len, True);
+	if(!h->count && !h->last) {
+		if(!(s = malloc(items[i].len)))
+			die("cannot malloc %u bytes:", items[i].len);
+		h->text = memcpy(s, TEXTOF(i), items[i].len);
+	}
+	h->count++;
+	h->last = time(NULL);
+	if(++nhistrec <= 2 * nhist + HISTSLACK) {
+		if((fp = fopen(histfile, "a"))) {
+			fprintf(fp, "%s1 %lu %.*s\n", histtorn ? "\n" : "", h->last,
+			        (int)items[i].len, TEXTOF(i));
+			histtorn = False;
+			fclose(fp);
+		}
+		return;
+	}
+	if(!(tmp = malloc(strlen(histfile) + 8)))
+		die("cannot malloc %u bytes:", strlen(histfile) + 8);
+	sprintf(tmp, "%s.XXXXXX", histfile);
+	if((fd = mkstemp(tmp)) < 0) {
+		free(tmp);
+		return;
+	}
+	if(!(fp = fdopen(fd, "w"))) {
+		close(fd);
+		unlink(tmp);
+		free(tmp);
+		return;
+	}
+	for(j = 0; j < nhist; j++)
+		fprintf(fp, "%lu %lu %.*s\n", hist[j].count, hist[j].last,
+		        (int)hist[j].len, hist[j].text);
+	if(fclose(fp) || rename(tmp, histfile))
+		unlink(tmp);
+	else
+		nhistrec = nhist;
+	free(tmp);
+}
+
+Hist *
+histfind(const char *s, size_t len, Bool add) {
+	size_t h, j, mask;
+	uint32_t e;
+
+	/* keep the set at most half full, so probes stay short */
+	if(add && 2 * (nhist + 1) > histcap) {
+		histcap = histcap ? histcap * 2 : 256;
+		free(histset);
+		if(!(histset = calloc(histcap, sizeof *histset))
+		|| !(hist = realloc(hist, histcap / 2 * sizeof *hist)))
+			die("cannot malloc %u bytes:", histcap * sizeof *histset);
+		for(mask = histcap - 1, j = 0; j < nhist; j++) {
+			for(h = strhash(hist[j].text, hist[j].len) & mask; histset[h]; h = (h + 1) & mask)
+				;
+			histset[h] = j + 1;
+		}
+	}
+	if(!histcap)
+		return NULL;
+	mask = histcap - 1;
+	for(h = strhash(s, len) & mask; (e = histset[h]); h = (h + 1) & mask)
+		if(hist[e-1].len == len && !memcmp(hist[e-1].text, s, len))
+			return &hist[e-1];
+	if(!add)
+		return NULL;
+	histset[h] = ++nhist;
+	hist[nhist-1].text = s;
+	hist[nhist-1].len = len;
+	hist[nhist-1].count = hist[nhist-1].last = 0;
+	return &hist[nhist-1];
+}
+
+void
+histload(void) {
+	struct stat st;
+	const char *p, *q, *end;
+	char *map, *e;
+	unsigned long count, last;
+	Hist *h;
+	int fd;
+
+	/* each line is a count, the time it was last chosen and the text.
+	   the texts stay in the mapped file. */
+	if((fd = open(histfile, O_RDONLY)) < 0)
+		return;
+	map = MAP_FAILED;
+	if(!fstat(fd, &st) && st.st_size > 0)
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(map == MAP_FAILED)
+		return;
+	end = map + st.st_size;
+	histtorn = end[-1] != '\n';
+	for(p = map; p < end && (q = memchr(p, '\n', end - p)); p = q + 1) {
+		count = strtoul(p, &e, 10);
+		if(*e != ' ')
+			continue;
+		last = strtoul(e + 1, &e, 10);
+		if(*e != ' ' || ++e >= q)
+			continue;
+		h = histfind(e, q - e, True);
+		h->count += count;
+		h->last = MAX(h->last, last);
+		nhistrec++;
+	}
+}
+
+int
+histscore(const Hist *h) {
+	unsigned long age = time(NULL) - h->last;
+	int w;
+
+	/* frecency: how often, weighted by how long ago */
+	if(age < 4 * 3600UL)
+		w = 100;
+	else if(age < 24 * 3600UL)
+		w = 80;
+	else if(age < 7 * 24 * 3600UL)
+		w = 60;
+	else if(age < 30 * 24 * 3600UL)
+		w = 40;
+	else
+		w = 20;
+	return MIN(h->count, (unsigned long)INT_MAX / 100) * w;
+}
+
+int
+hitcmp(const void *a, const void *b) {
+	const Hit *x = a, *y = b;
+
+	/* better scores go first, equal ones in input order */
+	if(x->score != y->score)
+		return x->score > y->score ? -1 : 1;
+	return x->idx < y->idx ? -1 : x->idx > y->idx;
+}
+
+int
+idxcmp(const void *a, const void *b) {
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
 void
 insert(const char *str, ssize_t n) {
 	if(strlen(text) + n > sizeof text - 1)
@@ -302,11 +1106,31 @@ insert(const char *str, ssize_t n) {
 	match();
 }
 
+int
+itemwidth(uint32_t i) {
+	/* measure each item once. fonts added as fallbacks do not change
+	   what was measured before, so only another first font does. */
+	if(nitems > itemwcap || drw->fonts[0] != itemwfont) {
+		if(!(itemw = realloc(itemw, nitems * sizeof *itemw)))
+			die("cannot realloc %u bytes:", nitems * sizeof *itemw);
+		if(drw->fonts[0] != itemwfont)
+			itemwcap = 0;
+		memset(&itemw[itemwcap], 0, (nitems - itemwcap) * sizeof *itemw);
+		itemwcap = nitems;
+		itemwfont = drw->fonts[0];
+	}
+	if(!itemw[i])
+		itemw[i] = TEXTW(showtext(i));
+	return itemw[i];
+}
+
 static KeySym lastksym = NoSymbol;
 void
 keypress(XKeyEvent *ev) {
 	char buf[32];
+	const char *s;
 	int len;
+	size_t n;
 	KeySym ksym = NoSymbol, oldksym;
 	Status status;
 
@@ -392,30 +1216,35 @@ keypress(XKeyEvent *ev) {
 			cursor = strlen(text);
 			break;
 		}
-		if(next) {
+		while(matchmore())
+			;
+		if(next < nmatches) {
 			/* jump to end of list and position items in reverse */
-			curr = matchend;
+			curr = nmatches - 1;
 			calcoffsets();
 			curr = prev;
 			calcoffsets();
-			while(next && (curr = curr->right))
+			while(next < nmatches) {
+				curr++;
 				calcoffsets();
+			}
 		}
-		sel = matchend;
+		if(nmatches)
+			sel = nmatches - 1;
 		break;
 	case XK_Escape:
 		cleanup();
 		exit(1);
 	case XK_Home:
-		if(sel == matches) {
+		if(sel == 0) {
 			cursor = 0;
 			break;
 		}
-		sel = curr = matches;
+		sel = curr = 0;
 		calcoffsets();
 		break;
 	case XK_Left:
-		if(cursor > 0 && (!sel || !sel->left || lines > 0)) {
+		if(cursor > 0 && (sel == 0 || lines > 0)) {
 			cursor = nextrune(-1);
 			break;
 		}
@@ -423,32 +1252,39 @@ keypress(XKeyEvent *ev) {
 			return;
 		/* fallthrough */
 	case XK_Up:
-		if(sel && sel->left && (sel = sel->left)->right == curr) {
+		if(sel > 0 && sel-- == curr) {
 			curr = prev;
 			calcoffsets();
 		}
 		break;
 	case XK_Next:
-		if(!next)
+		if(next >= nmatches)
 			return;
 		sel = curr = next;
 		calcoffsets();
 		break;
 	case XK_Prior:
-		if(!prev)
+		if(!nmatches)
 			return;
 		sel = curr = prev;
 		calcoffsets();
 		break;
 	case XK_Return:
 	case XK_KP_Enter:
-		puts((sel && !(ev->state & ShiftMask)) ? sel->text : text);
+		if(sel < nmatches && !(ev->state & ShiftMask)) {
+			s = fieldtext(matches[sel], FieldPrint, &n);
+			printf("%.*s\n", (int)n, s);
+			if(histfile)
+				histadd(matches[sel]);
+		}
+		else
+			puts(text);
 		if(!(ev->state & ControlMask)) {
 			cleanup();
 			exit(0);
 		}
-		if(sel)
-			sel->out = True;
+		if(sel < nmatches)
+			itemflags[matches[sel]] |= ItemOut;
 		break;
 	case XK_Right:
 		if(text[cursor] != '\0') {
@@ -459,19 +1295,22 @@ keypress(XKeyEvent *ev) {
 			return;
 		/* fallthrough */
 	case XK_Down:
-		if(sel && sel->right && (sel = sel->right) == next) {
+		if(sel + 1 < nmatches && ++sel == next) {
 			curr = next;
 			calcoffsets();
 		}
 		break;
 	case XK_ISO_Left_Tab:
 	case XK_Tab:
-		if(!sel)
+		if(sel >= nmatches)
 			return;
 		if (!tabcomplete ||
-		    !setcommonpref(oldksym == XK_Tab ? False : True))
-			strncpy(text, sel->text, sizeof text - 1);
-		text[sizeof text - 1] = '\0';
+		    !setcommonpref(oldksym == XK_Tab ? False : True)) {
+			s = fieldtext(matches[sel], FieldMatch, &n);
+			n = MIN(n, sizeof text - 1);
+			memcpy(text, s, n);
+			text[n] = '\0';
+		}
 		cursor = strlen(text);
 		match();
 		break;
@@ -479,89 +1318,492 @@ keypress(XKeyEvent *ev) {
 	drawmenu();
 }
 
+Bool
+loaditems(void) {
+	struct stat st, fst;
+	ItemFile *h;
+	char *map;
+	size_t n, off;
+	int fd, i;
+
+	/* the item file is used only if it was made from the same part of
+	   the same file, unchanged since, with the same options */
+	if(!itemfile || fstat(STDIN_FILENO, &st) || !S_ISREG(st.st_mode)
+	|| (fd = open(itemfile, O_RDONLY)) < 0)
+		return False;
+	map = MAP_FAILED;
+	if(!fstat(fd, &fst) && (size_t)fst.st_size >= sizeof *h)
+		map = mmap(NULL, fst.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(map == MAP_FAILED)
+		return False;
+	h = (ItemFile *)map;
+	n = h->nitems;
+	off = sizeof *h + ALIGN8(h->textlen) + ALIGN8(n * sizeof *items) + ALIGN8(n)
+	    + (delim ? ALIGN8(n * FieldLast * sizeof *fields) : 0) + ALIGN8(h->foldlen);
+	if(trigramindex)
+		off += ALIGN8((((size_t)1 << TGBITS) + 1) * sizeof *tgstart)
+		     + ALIGN8(h->npost * sizeof *tgpost);
+	if(memcmp(h->magic, ITEMMAGIC, sizeof h->magic)
+	|| h->dev != (uint64_t)st.st_dev || h->ino != (uint64_t)st.st_ino
+	|| h->size != (uint64_t)st.st_size || h->mtime != (uint64_t)st.st_mtim.tv_sec
+	|| h->mtimensec != (uint64_t)st.st_mtim.tv_nsec
+	|| h->start != (uint64_t)lseek(STDIN_FILENO, 0, SEEK_CUR)
+	|| h->flags != ITEMFLAGS
+	|| h->delim != delimcode
+	|| memcmp(h->fieldlo, fieldlo, sizeof fieldlo) || memcmp(h->fieldhi, fieldhi, sizeof fieldhi)
+	|| h->tgbits != TGBITS || off != (size_t)fst.st_size) {
+		munmap(map, fst.st_size);
+		return False;
+	}
+	/* everything is used in place but the flags, which get written */
+	off = sizeof *h;
+	textbuf = map + off;
+	off += ALIGN8(h->textlen);
+	items = (Item *)(map + off);
+	off += ALIGN8(n * sizeof *items);
+	if(!(itemflags = malloc(MAX(n, 1))) || !(matches = malloc(MAX(n, 1) * sizeof *matches)))
+		die("cannot malloc %u bytes:", MAX(n, 1) * sizeof *matches);
+	memcpy(itemflags, map + off, n);
+	off += ALIGN8(n);
+	if(delim) {
+		fields = (Field *)(map + off);
+		off += ALIGN8(n * FieldLast * sizeof *fields);
+	}
+	folds.buf = map + off;
+	folds.len = h->foldlen;
+	off += ALIGN8(h->foldlen);
+	if(trigramindex) {
+		tgstart = (uint32_t *)(map + off);
+		off += ALIGN8((((size_t)1 << TGBITS) + 1) * sizeof *tgstart);
+		tgpost = (uint32_t *)(map + off);
+	}
+	for(i = 0; i < 256; i++)
+		bytefreq[i] = h->bytefreq[i];
+	nitems = n;
+	nvisible = h->nvisible;
+	mapped = True;
+	widest = h->widest;
+	if(stats)
+		fprintf(stderr, "dmenu: %lu items from %s\n", (unsigned long)n, itemfile);
+	return True;
+}
+
+char *
+mapstdin(size_t *start, size_t *size) {
+	struct stat st;
+	off_t off;
+	char *map;
+
+	/* the mapping is only read, so pages are shared with the page
+	   cache. it is a byte longer than the file, over zeroed memory if
+	   need be, so the byte after the last line can be read. */
+	if(fstat(STDIN_FILENO, &st) || !S_ISREG(st.st_mode)
+	|| (off = lseek(STDIN_FILENO, 0, SEEK_CUR)) < 0
+	|| st.st_size <= off || (uintmax_t)st.st_size >= NOFOLD)
+		return NULL;
+	if((map = mmap(NULL, st.st_size + 1, PROT_READ,
+	               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED)
+		return NULL;
+	if(mmap(map, st.st_size, PROT_READ, MAP_PRIVATE | MAP_FIXED,
+	        STDIN_FILENO, 0) == MAP_FAILED) {
+		munmap(map, st.st_size + 1);
+		return NULL;
+	}
+	*start = off;
+	*size = st.st_size;
+	return map;
+}
+
 void
 match(void) {
-	static char **tokv = NULL;
-	static int tokn = 0;
+	static uint32_t *cand = NULL;
+	static size_t candcap = 0;
+	static int tokn = 0, tokln = 0;
 
-	char buf[sizeof text], *s;
-	int i, tokc = 0;
-	size_t len;
-	Item *item, *lprefix, *lsubstr, *prefixend, *substrend;
+	char buf[2 * sizeof text], *s;
+	int i, t;
+	size_t n, k;
+	Bool usecand, lazy;
 
-	strcpy(buf, text);
+	/* with a folded shadow, -i is a case-sensitive match of folded text */
+	tokcmp = shadow ? strncmp : fstrncmp;
+	tokfind = shadow ? memfind : fstrstr;
+	if(shadow)
+		foldcase(buf, sizeof buf, text, strlen(text));
+	else
+		strcpy(buf, text);
 	/* separate input text into tokens to be matched individually */
+	tokc = 0;
 	for(s = strtok(buf, " "); s; tokv[tokc-1] = s, s = strtok(NULL, " "))
 		if(++tokc > tokn && !(tokv = realloc(tokv, ++tokn * sizeof *tokv)))
 			die("cannot realloc %u bytes\n", tokn * sizeof *tokv);
-	if (tokc && unitary) {
-		strcpy(buf, text);
+	if (tokc && (unitary || regex)) {
+		if(shadow)
+			foldcase(buf, sizeof buf, text, strlen(text));
+		else
+			strcpy(buf, text);
 		tokc = 1;
 		tokv[0] = buf;
 	}
-	len = tokc ? strlen(tokv[0]) : 0;
+	if(tokc > tokln && (!(tokl = realloc(tokl, (tokln = tokc) * sizeof *tokl))
+	                    || !(tokord = realloc(tokord, tokln * sizeof *tokord))))
+		die("cannot realloc %u bytes\n", tokln * sizeof *tokl);
+	for(i = 0; i < tokc; i++)
+		tokl[i] = strlen(tokv[i]);
+	/* try the tokens that fewest items contain first, so most items are
+	   rejected after one search. the order of the matches is unchanged
+	   since only the first token decides the tiers. */
+	for(i = 0; i < tokc; i++) {
+		for(t = i; t > 0 && tokfreq(tokv[tokord[t-1]], tokl[tokord[t-1]])
+		                    > tokfreq(tokv[i], tokl[i]); t--)
+			tokord[t] = tokord[t-1];
+		tokord[t] = i;
+	}
 
-	matches = lprefix = lsubstr = matchend = prefixend = substrend = NULL;
-	for(item = items; item && item->text; item++) {
-		for(i = 0; i < tokc; i++)
-			if(!fstrstr(item->text, tokv[i]))
-				break;
-		if(i != tokc) /* not all tokens match */
-			continue;
-		/* exact matches go first, then prefixes, then substrings */
-		if(!tokc || !fstrncmp(tokv[0], item->text, len+1)) {
-			if (tokc || !item->hidden)
-				appenditem(item, &matches, &matchend);
+	rest.start = rest.end = 0;
+	if(fuzzy && tokc) {
+		/* ranked matches are not in tiers, so nothing narrows them */
+		lasttext[0] = '\0';
+		fuzzyk = FUZZYPAGES * (lines > 0 ? lines : 32);
+		matchfuzzy(0);
+		curr = sel = 0;
+		calcoffsets();
+		return;
+	}
+
+	/* a pattern is compiled once for all items, before the cache is
+	   tried, since items read later by -a are matched with it too. it
+	   may match more as it grows, so neither narrowing nor the index
+	   apply to it. */
+	if(regex) {
+		rxfree(rx);
+		rx = tokc ? rxcompile(tokv[0], icase) : NULL;
+	}
+
+	/* going back to an earlier text restores its result from the cache */
+	for(matchkey[0] = '\0', i = 0; i < tokc; i++) {
+		if(i)
+			strcat(matchkey, " ");
+		strcat(matchkey, tokv[i]);
+	}
+	if(tokc && cacheget()) {
+		strcpy(lasttext, text);
+		curr = sel = 0;
+		calcoffsets();
+		return;
+	}
+
+	/* use the trigram index if some token is long enough for it. else,
+	   if text only grew at the end, every new match was also a match
+	   for the last text, so only the last result has to be rescanned.
+	   an empty last text is excluded since it left out hidden items. */
+	if(nitems > candcap && !(cand = realloc(cand, (candcap = nitems) * sizeof *cand)))
+		die("cannot realloc %u bytes:", candcap * sizeof *cand);
+	/* empty text only lists the visible items, which come first */
+	n = tokc ? nitems : nvisible;
+	usecand = !regex && tgpost && trigramcands(cand, &n);
+	if(!usecand && !regex && tokc && lasttext[0] && !strncmp(text, lasttext, strlen(lasttext))) {
+		n = mergetiers(cand);
+		usecand = True;
+	}
+	lasttext[0] = '\0';
+	nmatches = 0;
+	memset(ntier, 0, sizeof ntier);
+
+	/* -L leaves the last tier, which is the only one for empty text,
+	   for matchmore() to scan as far as needed. the other tiers take
+	   much less than a full match to find, since they only need the
+	   first token to be a prefix. a pattern has to be run in full for
+	   any tier, so -r matches everything at once. */
+	lazy = lazymatch && !(regex && tokc);
+	rest.cand = usecand ? cand : NULL;
+	rest.start = 0;
+	rest.end = lazy ? n : 0;
+	rest.tiers = 1 << (tokc ? TierSubstr : TierExact);
+
+	/* split the scan into shards of consecutive candidates, which keeps
+	   every tier of every shard in input order */
+	if(!shards)
+		poolinit();
+	k = MAX(1, MIN((size_t)nworkers + 1, n / SHARDMIN));
+	for(i = 0; (size_t)i < k; i++) {
+		shards[i].cand = usecand ? cand : NULL;
+		shards[i].start = n * i / k;
+		shards[i].end = lazy && !tokc ? 0 : n * (i + 1) / k;
+		shards[i].tiers = ((1 << TierLast) - 1) & ~(lazy ? rest.tiers : 0);
+	}
+	poolrun(k);
+
+	/* exact matches go first, then prefixes, then substrings */
+	for(t = 0; t < TierLast; t++)
+		for(i = 0; (size_t)i < k; i++)
+			appendtier(&shards[i], t);
+	if(rest.start == rest.end)
+		matchdone();
+	while(!nmatches && matchmore())
+		;
+	curr = sel = 0;
+	calcoffsets();
+}
+
+void
+matchdone(void) {
+	/* narrowing and the cache need the whole result, of some items */
+	if(!tokc || !nitems)
+		return;
+	strcpy(lasttext, text);
+	cacheput();
+}
+
+Bool
+matchmore(void) {
+	size_t end;
+	int t;
+
+	/* rank twice as many fuzzy matches; the ones listed so far stay */
+	if(fuzzy && tokc) {
+		if(nfuzzy <= fuzzyk)
+			return False;
+		fuzzyk *= 2;
+		matchfuzzy(0);
+		return True;
+	}
+	if(rest.start == rest.end)
+		return False;
+	end = rest.end;
+	rest.end = MIN(rest.start + LAZYCHUNK, end);
+	matchshard(&rest);
+	for(t = 0; t < TierLast; t++)
+		appendtier(&rest, t);
+	rest.start = rest.end;
+	if((rest.end = end) == rest.start)
+		matchdone();
+	return True;
+}
+
+void
+matchfuzzy(size_t from) {
+	static Hit *hits = NULL;	/* the ranked matches first */
+	static size_t cap = 0;
+	size_t i, k, n;
+
+	if(!shards)
+		poolinit();
+	if(fuzzyk > cap) {
+		cap = fuzzyk;
+		for(i = 0; i <= (size_t)nworkers; i++)
+			if(!(shards[i].hits = realloc(shards[i].hits, cap * sizeof *hits)))
+				die("cannot realloc %u bytes:", cap * sizeof *hits);
+		if(!(hits = realloc(hits, (nworkers + 2) * cap * sizeof *hits)))
+			die("cannot realloc %u bytes:", (nworkers + 2) * cap * sizeof *hits);
+	}
+	/* rank the items from from on. those before were ranked already,
+	   and the best fuzzyk of them are the matches. */
+	k = MAX(1, MIN((size_t)nworkers + 1, (nitems - from) / SHARDMIN));
+	for(i = 0; i < k; i++) {
+		shards[i].cand = NULL;
+		shards[i].start = from + (nitems - from) * i / k;
+		shards[i].end = from + (nitems - from) * (i + 1) / k;
+	}
+	poolrun(k);
+	/* the best fuzzyk of those and of the best fuzzyk of each shard */
+	n = from ? nmatches : 0;
+	if(!from)
+		nfuzzy = 0;
+	for(i = 0; i < k; i++) {
+		memcpy(&hits[n], shards[i].hits, shards[i].nhits * sizeof *hits);
+		n += shards[i].nhits;
+		nfuzzy += shards[i].nmatch;
+	}
+	qsort(hits, n, sizeof *hits, hitcmp);
+	for(nmatches = 0; nmatches < MIN(n, fuzzyk); nmatches++)
+		matches[nmatches] = hits[nmatches].idx;
+}
+
+void
+matchnew(size_t from) {
+	static Shard sh;
+	size_t add, end, start, n;
+	uint32_t item = 0;
+	int t;
+	Bool lazy, empty = !nmatches;
+
+	/* a narrowed -L scan is finished first, as it only has the old
+	   items to go through. then the cached results lack the new ones. */
+	if(!(fuzzy && tokc) && rest.start < rest.end && rest.cand)
+		while(matchmore())
+			;
+	cacheclear();
+	if(fuzzy && tokc) {
+		/* rank the new items in and keep the selected item selected */
+		if(!empty)
+			item = matches[sel];
+		matchfuzzy(from);
+		for(n = 0; n < nmatches && matches[n] != item; n++)
+			;
+		sel = !empty && n < nmatches ? n : 0;
+	}
+	else {
+		/* a full -L scan goes on to the new items */
+		lazy = rest.start < rest.end;
+		sh.cand = NULL;
+		sh.end = tokc ? nitems : nvisible;
+		sh.start = MIN(from, sh.end);
+		sh.tiers = ((1 << TierLast) - 1) & ~(lazy ? rest.tiers : 0);
+		matchshard(&sh);
+		if(lazy)
+			rest.end = sh.end;
+		/* the new matches of each tier go at its end, so the tiers stay
+		   in input order. tiers are moved along from the last, and the
+		   selection with them. */
+		for(add = 0, t = 0; t < TierLast; t++)
+			add += sh.nfound[t];
+		for(end = nmatches, t = TierLast - 1; t >= 0; t--) {
+			start = end - ntier[t];
+			add -= sh.nfound[t];
+			if(sh.nfound[t] && sel >= end && !empty)
+				sel += sh.nfound[t];
+			if(sh.nfound[t] && curr >= end && !empty)
+				curr += sh.nfound[t];
+			memmove(&matches[start + add], &matches[start], ntier[t] * sizeof *matches);
+			if(sh.nfound[t])
+				memcpy(&matches[start + add + ntier[t]], sh.found[t],
+				       sh.nfound[t] * sizeof *matches);
+			nmatches += sh.nfound[t];
+			ntier[t] += sh.nfound[t];
+			end = start;
 		}
-		else if(!fstrncmp(tokv[0], item->text, len))
-			appenditem(item, &lprefix, &prefixend);
-		else
-			appenditem(item, &lsubstr, &substrend);
 	}
-	if(lprefix) {
-		if(matches) {
-			matchend->right = lprefix;
-			lprefix->left = matchend;
+	/* keep the selection on the page */
+	curr = MIN(curr, sel);
+	calcoffsets();
+	if(sel >= next) {
+		curr = sel;
+		calcoffsets();
+	}
+}
+
+void
+matchshard(Shard *sh) {
+	size_t i, len = tokc ? tokl[0] : 0, itemlen;
+	int j, t;
+	uint32_t idx;
+	const char *s;
+	RxSpace *sp = NULL;
+
+	if(fuzzy && tokc) {
+		fuzzyshard(sh);
+		return;
+	}
+	for(t = 0; t < TierLast; t++)
+		sh->nfound[t] = 0;
+	if(tokc && regex && rx)
+		sp = rxspace(rx);
+	for(i = sh->start; i < sh->end; i++) {
+		idx = sh->cand ? sh->cand[i] : i;
+		s = matchtext(idx, &itemlen);
+		if(tokc && regex) {
+			t = rx ? rxtier[rxmatch(rx, s, itemlen, sp)] : TierLast;
+			if(t != TierLast && sh->tiers & 1 << t)
+				appenditem(sh, t, idx);
+			continue;
 		}
+		/* exact matches go first, then prefixes, then substrings */
+		if(!tokc)
+			t = TierExact;
+		else if(len > itemlen || tokcmp(tokv[0], s, len))
+			t = TierSubstr;
 		else
-			matches = lprefix;
-		matchend = prefixend;
+			t = len == itemlen ? TierExact : TierPrefix;
+		if(t == TierLast || !(sh->tiers & 1 << t))
+			continue;
+		/* the first token is known to match unless it is a substring */
+		for(j = 0; j < tokc; j++)
+			if((tokord[j] || t == TierSubstr)
+			&& !tokfind(s, itemlen, tokv[tokord[j]], tokl[tokord[j]]))
+				break;
+		if(j < tokc) /* not all tokens match */
+			continue;
+		appenditem(sh, t, idx);
 	}
-	if(lsubstr) {
-		if(matches) {
-			matchend->right = lsubstr;
-			lsubstr->left = matchend;
+	rxspacefree(sp);
+}
+
+void *
+matchworker(void *arg) {
+	Shard *sh = arg;
+	unsigned long gen = 0;
+
+	pthread_mutex_lock(&poollock);
+	for(;;) {
+		while(gen == poolgen)
+			pthread_cond_wait(&poolwake, &poollock);
+		gen = poolgen;
+		if((size_t)(sh - shards) < poolused) {
+			pthread_mutex_unlock(&poollock);
+			matchshard(sh);
+			pthread_mutex_lock(&poollock);
 		}
-		else
-			matches = lsubstr;
-		matchend = substrend;
+		if(--poolbusy == 0)
+			pthread_cond_signal(&pooldone);
+	}
+	return NULL;
+}
+
+const char *
+matchtext(uint32_t i, size_t *len) {
+	/* the text of item i as it is matched */
+	if(shadow && items[i].foff != NOFOLD) {
+		*len = items[i].flen;
+		return &folds.buf[items[i].foff];
+	}
+	return fieldtext(i, FieldMatch, len);
+}
+
+size_t
+mergetiers(uint32_t *cand) {
+	size_t pos[TierLast], end[TierLast], n = 0;
+	int t, u;
+
+	/* each tier of the last result is in input order, so merging them
+	   yields the last matches in input order too */
+	for(t = 0; t < TierLast; t++) {
+		pos[t] = t ? end[t-1] : 0;
+		end[t] = pos[t] + ntier[t];
+	}
+	for(;;) {
+		for(u = -1, t = 0; t < TierLast; t++)
+			if(pos[t] < end[t] && (u < 0 || matches[pos[t]] < matches[pos[u]]))
+				u = t;
+		if(u < 0)
+			return n;
+		cand[n++] = matches[pos[u]++];
 	}
-	curr = sel = matches;
-	calcoffsets();
 }
 
 Bool
 setcommonpref(Bool again) {
-	size_t len, t, start, maxlen;
+	size_t len, t, start, maxlen, i;
 	int c;
-	Item *item, *prefitem;
+	const char *item, *prefitem;
 
-	if (!curr || text[0] == 0) {
+	if (!nmatches || text[0] == 0) {
 		return False;
 	}
 
 	/* Find an item that is a suffix of the current text, and the
 	   minimum length of all items that are suffixes of the current
 	   text. */
-	maxlen = sizeof(text);
+	maxlen = sizeof(text) - 1;
 	prefitem = NULL;
 	start = strlen(text);
-	for (item = curr; item != next; item = item->right) {
-		if (fstrncmp(item->text, text, start) != 0)
+	for (i = curr; i < next; i++) {
+		item = fieldtext(matches[i], FieldMatch, &t);
+		if (t < start || fstrncmp(item, text, start) != 0)
 			continue;
 		if (!prefitem)
 			prefitem = item;
-		t = strlen(item->text);
 		if (maxlen > t)
 			maxlen = t;
 		break;
@@ -571,22 +1813,24 @@ setcommonpref(Bool again) {
 
 	/* Repeatedly attempt to lengthen the common prefix. */
 	for (len = start; len < maxlen; len++) {
-		c = prefitem->text[len];
-		for (item = curr; item != next; item = item->right) {
-			if (fstrncmp(item->text, text, start) != 0)
+		c = prefitem[len];
+		for (i = curr; i < next; i++) {
+			item = fieldtext(matches[i], FieldMatch, &t);
+			if (t < start || fstrncmp(item, text, start) != 0)
 				continue;
-			if (item->text[len] != c) {
+			if (len >= t || item[len] != c) {
 				if (len == start)
 					return again;
 				else {
-					strncpy(text, item->text, len);
+					strncpy(text, item, len);
 					text[len] = 0;
 				}
 				return True;
 			}
 		}
 	}
-	strncpy(text, prefitem->text, len+1);
+	strncpy(text, prefitem, len);
+	text[len] = 0;
 	return True;
 }
 
@@ -599,6 +1843,37 @@ nextrune(int inc) {
 	return n;
 }
 
+void
+parsefields(void) {
+	const char *s;
+	char *end;
+	int f;
+
+	/* fields are split at the first character of delim, which may take
+	   more than one byte in UTF-8 */
+	for(delimlen = 0; delim && delim[delimlen] && delimlen < 4
+	    && (!delimlen || (delim[delimlen] & 0xc0) == 0x80); delimlen++)
+		delimcode = delimcode << 8 | (unsigned char)delim[delimlen];
+	/* a field, or a range of them with either end left open */
+	for(f = 0; f < FieldLast; f++) {
+		s = fieldspec[f];
+		fieldlo[f] = 1;
+		fieldhi[f] = UINT_MAX;
+		if(*s != '-') {
+			fieldlo[f] = strtoul(s, &end, 10);
+			s = end;
+		}
+		if(*s != '-')
+			fieldhi[f] = fieldlo[f];
+		else if(*++s) {
+			fieldhi[f] = strtoul(s, &end, 10);
+			s = end;
+		}
+		if(*s || !fieldlo[f] || fieldhi[f] < fieldlo[f])
+			die("bad field range: %s\n", fieldspec[f]);
+	}
+}
+
 void
 paste(void) {
 	char *p, *q;
@@ -615,42 +1890,222 @@ paste(void) {
 }
 
 void
-readstdin(void) {
-	char buf[sizeof text], *p, *maxstr = NULL;
-	size_t i, max = 0, size = 0;
-	Bool hidden = False;
+poolinit(void) {
+	pthread_t tid;
+	int i;
 
-	/* read each line from stdin and add it to the item list */
-	for(i = 0; fgets(buf, sizeof buf, stdin); i++) {
-		/* blank line == start hiding items from normal display */
-		if(buf[0] == '\n') {
-			hidden = True;
-			i--;
+	nworkers = (threads ? threads : (int)sysconf(_SC_NPROCESSORS_ONLN)) - 1;
+	nworkers = MAX(nworkers, 0);
+	if(!(shards = calloc(nworkers + 1, sizeof *shards)))
+		die("cannot malloc %u bytes:", (nworkers + 1) * sizeof *shards);
+	for(i = 1; i <= nworkers; i++)
+		if(pthread_create(&tid, NULL, matchworker, &shards[i]))
+			die("cannot create match worker\n");
+}
+
+void
+poolrun(size_t k) {
+	/* the calling thread matches the first of the k shards */
+	if(k > 1) {
+		pthread_mutex_lock(&poollock);
+		poolused = k;
+		poolbusy = nworkers;
+		poolgen++;
+		pthread_cond_broadcast(&poolwake);
+		pthread_mutex_unlock(&poollock);
+	}
+	matchshard(&shards[0]);
+	if(k > 1) {
+		pthread_mutex_lock(&poollock);
+		while(poolbusy)
+			pthread_cond_wait(&pooldone, &poollock);
+		pthread_mutex_unlock(&poollock);
+	}
+}
+
+void
+rankitems(void) {
+	Hit *hits = NULL;
+	Hist *h;
+	Item *oitems = items;
+	Field *ofields = fields;
+	unsigned char *oflags = itemflags;
+	uint32_t *pos, *post;
+	size_t i, j, k, nhits = 0, cap = 0, nvis, b, nb = (size_t)1 << TGBITS;
+
+	/* items chosen before go first among the visible or hidden items,
+	   best frecency first. moving them there keeps every other part
+	   of matching in item order, and costs one probe per item. */
+	for(i = 0; i < nitems; i++) {
+		if(!(h = histfind(TEXTOF(i), items[i].len, False)))
 			continue;
+		if(nhits == cap && !(hits = realloc(hits, (cap = cap ? cap * 2 : 64) * sizeof *hits)))
+			die("cannot realloc %u bytes:", cap * sizeof *hits);
+		hits[nhits].score = histscore(h);
+		hits[nhits++].idx = i;
+	}
+	if(!nhits)
+		return;
+	for(nvis = 0; nvis < nhits && hits[nvis].idx < nvisible; nvis++)
+		;
+	qsort(hits, nvis, sizeof *hits, hitcmp);
+	qsort(&hits[nvis], nhits - nvis, sizeof *hits, hitcmp);
+
+	/* pos[i] is where item i goes */
+	if(!(pos = malloc(nitems * sizeof *pos)))
+		die("cannot malloc %u bytes:", nitems * sizeof *pos);
+	for(i = 0; i < nitems; i++)
+		pos[i] = NOFOLD;
+	for(j = k = 0, i = 0; i < nitems; i++) {
+		for(; i == 0 && j < nvis; j++)
+			pos[hits[j].idx] = k++;
+		for(; i == nvisible && j < nhits; j++)
+			pos[hits[j].idx] = k++;
+		if(pos[i] == NOFOLD)
+			pos[i] = k++;
+	}
+	if(!(items = malloc(nitems * sizeof *items))
+	|| !(itemflags = malloc(nitems))
+	|| (ofields && !(fields = malloc(nitems * FieldLast * sizeof *fields))))
+		die("cannot malloc %u bytes:", nitems * sizeof *items);
+	for(i = 0; i < nitems; i++) {
+		items[pos[i]] = oitems[i];
+		itemflags[pos[i]] = oflags[i];
+		if(ofields)
+			memcpy(&fields[pos[i] * FieldLast], &ofields[i * FieldLast],
+			       FieldLast * sizeof *fields);
+	}
+	widest = pos[widest];
+	free(oflags);
+	if(!mapped) {
+		free(oitems);
+		free(ofields);
+	}
+
+	/* the index lists each bucket in item order too. only buckets
+	   holding items that moved have to be sorted again. */
+	if(tgpost) {
+		if(!mapped)
+			post = tgpost;
+		else if(!(post = malloc(MAX(tgstart[nb], 1) * sizeof *post)))
+			die("cannot malloc %u bytes:", tgstart[nb] * sizeof *post);
+		for(b = 0; b < nb; b++) {
+			for(k = 0, i = tgstart[b]; i < tgstart[b + 1]; i++) {
+				post[i] = pos[tgpost[i]];
+				k |= i > tgstart[b] && post[i] < post[i-1];
+			}
+			if(k)
+				qsort(&post[tgstart[b]], tgstart[b + 1] - tgstart[b], sizeof *post, idxcmp);
 		}
-		if(i+1 >= size / sizeof *items)
-			if(!(items = realloc(items, (size += BUFSIZ))))
-				die("cannot realloc %u bytes:", size);
-		if((p = strchr(buf, '\n')))
-			*p = '\0';
-		if(!(items[i].text = strdup(buf)))
-			die("cannot strdup %u bytes:", strlen(buf)+1);
-		items[i].out = False;
-		items[i].hidden = hidden;
-		if(strlen(items[i].text) > max)
-			max = strlen(maxstr = items[i].text);
+		tgpost = post;
+	}
+	free(pos);
+	free(hits);
+}
+
+Bool
+readblock(void) {
+	static size_t line = 0;	/* where the unfinished line starts */
+	ssize_t n;
+	char *p;
+
+	/* read a block to the end of the text arena and add the lines it
+	   finishes. the lines stay in place, however long. */
+	arenagrow(&texts, READSIZE + 1);
+	while((n = read(STDIN_FILENO, &texts.buf[texts.len], READSIZE)) < 0 && errno == EINTR)
+		;
+	textbuf = texts.buf;
+	if(n <= 0) {
+		/* end the last line even if it has no newline */
+		texts.buf[texts.len] = '\0';
+		line = addlines(texts.buf, line, texts.len, True);
+		return False;
+	}
+	p = &texts.buf[texts.len];
+	texts.len += n;
+	if(memchr(p, '\n', n))
+		line = addlines(texts.buf, line, texts.len, False);
+	return True;
+}
+
+void
+readstdin(void) {
+	char *map;
+	size_t start, size;
+
+	shadow = icase && foldshadow;
+	/* the history is needed to add to it even if items are not ranked */
+	if(histfile)
+		histload();
+	/* the items of a regular file may be in an item file already */
+	if(loaditems())
+		;
+	/* else a regular file is mapped rather than read, and its items
+	   are the lines in place */
+	else if((map = mapstdin(&start, &size))) {
+		textbuf = map;
+		addlines(map, start, size, True);
+		if(trigramindex)
+			buildtrigrams();
+		if(itemfile)
+			saveitems(map, size + 1);
+	}
+	/* -a reads a pipe while running, see readstream() */
+	else if(async) {
+		reading = True;
+		return;
+	}
+	else {
+		while(readblock())
+			;
+		if(trigramindex)
+			buildtrigrams();
+	}
+	if(histfile)
+		rankitems();
+	inputw = nitems ? TEXTW(showtext(widest)) : 0;
+	lines = MIN(lines, nitems);
+}
+
+void
+readstream(void) {
+	size_t from = nitems;
+
+	/* take in what stdin has for -a, and match the new items into the
+	   current result */
+	if(!readblock()) {
+		reading = False;
+		if(trigramindex)
+			buildtrigrams();
 	}
-	if(items)
-		items[i].text = NULL;
-	inputw = maxstr ? TEXTW(maxstr) : 0;
-	lines = MIN(lines, i);
+	if(nitems == from)
+		return;
+	matchnew(from);
+	inputw = MIN(TEXTW(showtext(widest)), mw/3);
+	drawmenu();
 }
 
 void
 run(void) {
 	XEvent ev;
+	struct pollfd fds[2];
 
-	while(!XNextEvent(dpy, &ev)) {
+	fds[0].fd = ConnectionNumber(dpy);
+	fds[1].fd = STDIN_FILENO;
+	fds[0].events = fds[1].events = POLLIN;
+	for(;;) {
+		/* go on with a lazy match while there is nothing else to do */
+		while(rest.start < rest.end && !XPending(dpy))
+			matchmore();
+		/* -a: read stdin until an X event comes in */
+		while(reading && !XPending(dpy)) {
+			if(poll(fds, LENGTH(fds), -1) < 0 && errno != EINTR)
+				die("poll:");
+			if(fds[1].revents)
+				readstream();
+		}
+		if(XNextEvent(dpy, &ev))
+			break;
 		if(XFilterEvent(&ev, win))
 			continue;
 		switch(ev.type) {
@@ -673,6 +2128,76 @@ run(void) {
 	}
 }
 
+void
+saveitems(const char *text, size_t textlen) {
+	static const char zero[8];
+	struct stat st;
+	ItemFile h;
+	struct { const void *p; size_t n; } part[8];
+	char *tmp;
+	FILE *fp = NULL;
+	int i, fd, n = 0;
+
+	/* write a new item file next to the old one, under a name of its
+	   own, and move it over, so another dmenu never sees half of it */
+	if(fstat(STDIN_FILENO, &st))
+		return;
+	memset(&h, 0, sizeof h);
+	memcpy(h.magic, ITEMMAGIC, sizeof h.magic);
+	h.dev = st.st_dev;
+	h.ino = st.st_ino;
+	h.size = st.st_size;
+	h.mtime = st.st_mtim.tv_sec;
+	h.mtimensec = st.st_mtim.tv_nsec;
+	h.start = lseek(STDIN_FILENO, 0, SEEK_CUR);
+	h.flags = ITEMFLAGS;
+	h.nitems = nitems;
+	h.widest = widest;
+	h.tgbits = TGBITS;
+	h.delim = delimcode;
+	h.nvisible = nvisible;
+	memcpy(h.fieldlo, fieldlo, sizeof fieldlo);
+	memcpy(h.fieldhi, fieldhi, sizeof fieldhi);
+	h.textlen = textlen;
+	h.foldlen = folds.len;
+	h.npost = tgpost ? tgstart[(size_t)1 << TGBITS] : 0;
+	for(i = 0; i < 256; i++)
+		h.bytefreq[i] = bytefreq[i];
+	part[n].p = &h;         part[n++].n = sizeof h;
+	part[n].p = text;       part[n++].n = textlen;
+	part[n].p = items;      part[n++].n = nitems * sizeof *items;
+	part[n].p = itemflags;  part[n++].n = nitems;
+	if(fields) {
+		part[n].p = fields; part[n++].n = nitems * FieldLast * sizeof *fields;
+	}
+	part[n].p = folds.buf;  part[n++].n = folds.len;
+	if(tgpost) {
+		part[n].p = tgstart; part[n++].n = (((size_t)1 << TGBITS) + 1) * sizeof *tgstart;
+		part[n].p = tgpost;  part[n++].n = h.npost * sizeof *tgpost;
+	}
+	if(!(tmp = malloc(strlen(itemfile) + 8)))
+		die("cannot malloc %u bytes:", strlen(itemfile) + 8);
+	sprintf(tmp, "%s.XXXXXX", itemfile);
+	if((fd = mkstemp(tmp)) < 0 || !(fp = fdopen(fd, "w"))) {
+		fprintf(stderr, "warning: cannot write item file %s\n", tmp);
+		if(fd >= 0) {
+			close(fd);
+			unlink(tmp);
+		}
+		free(tmp);
+		return;
+	}
+	for(i = 0; i < n; i++)
+		if(fwrite(part[i].p, 1, part[i].n, fp) != part[i].n
+		|| fwrite(zero, 1, ALIGN8(part[i].n) - part[i].n, fp) != ALIGN8(part[i].n) - part[i].n)
+			break;
+	if(fclose(fp) || i < n || rename(tmp, itemfile)) {
+		fprintf(stderr, "warning: cannot write item file %s\n", itemfile);
+		unlink(tmp);
+	}
+	free(tmp);
+}
+
 void
 setup(void) {
 	int x, y;
@@ -766,9 +2291,128 @@ setup(void) {
 	drawmenu();
 }
 
+const char *
+showtext(uint32_t i) {
+	static char *buf = NULL;
+	static size_t cap = 0;
+	const char *s;
+	size_t len;
+
+	/* the fields of item i that -df picks, ending in a NUL for drawing.
+	   they do already if they run to the end of the input. */
+	s = fieldtext(i, FieldShow, &len);
+	if(!s[len])
+		return s;
+	if(len >= cap) {
+		cap = len + 1;
+		if(!(buf = realloc(buf, cap)))
+			die("cannot realloc %u bytes:", cap);
+	}
+	memcpy(buf, s, len);
+	buf[len] = '\0';
+	return buf;
+}
+
+void
+splitfield(const char *s, uint32_t off, size_t len, int f) {
+	const char *p = s, *q, *end = s + len;
+	unsigned int k;
+	Field *fl = &fields[nitems * FieldLast + f];
+
+	/* find fields fieldlo[f] to fieldhi[f] of the item s, which is at
+	   off in textbuf. those past the last are empty. */
+	for(k = 1; k < fieldlo[f]; k++)
+		p = (q = memfind(p, end - p, delim, delimlen)) ? q + delimlen : end;
+	fl->off = off + (p - s);
+	for(; k < fieldhi[f] && (q = memfind(p, end - p, delim, delimlen)); k++)
+		p = q + delimlen;
+	fl->len = ((q = memfind(p, end - p, delim, delimlen)) ? q : end) - s - (fl->off - off);
+}
+
+uint32_t
+strhash(const char *s, size_t len) {
+	uint32_t h = 2166136261UL;
+
+	/* FNV-1a */
+	while(len--)
+		h = (h ^ (unsigned char)*s++) * 16777619UL;
+	return h;
+}
+
+unsigned int
+tghash(const char *s) {
+	unsigned long k = 0;
+	unsigned char c;
+	int i;
+
+	for(i = 0; i < 3; i++) {
+		c = s[i];
+		k = k << 8 | FOLDBYTE(c);
+	}
+	return ((k * 2654435761UL) & 0xffffffffUL) >> (32 - TGBITS);
+}
+
+size_t
+tokfreq(const char *s, size_t len) {
+	size_t i, freq = nitems;
+
+	/* no more items contain s than contain its rarest byte */
+	for(i = 0; i < len; i++)
+		freq = MIN(freq, bytefreq[FOLDBYTE((unsigned char)s[i])]);
+	return freq;
+}
+
+Bool
+trigramcands(uint32_t *cand, size_t *n) {
+	size_t i, j, k, r, m, lo, hi, mid, step, rn = 0, best = 0;
+	uint32_t *list;
+	Bool found = False;
+	int t;
+
+	/* start from the shortest posting list among the trigrams of all
+	   tokens, then drop the candidates missing from any other list */
+	for(t = 0; t < tokc; t++)
+		for(i = 0; i + 3 <= tokl[t]; i++) {
+			j = tghash(&tokv[t][i]);
+			if(!found || tgstart[j + 1] - tgstart[j] < rn) {
+				best = j;
+				rn = tgstart[j + 1] - tgstart[j];
+				found = True;
+			}
+		}
+	if(!found)
+		return False;
+	memcpy(cand, &tgpost[tgstart[best]], rn * sizeof *cand);
+	for(t = 0; t < tokc && rn; t++)
+		for(i = 0; i + 3 <= tokl[t] && rn; i++) {
+			if((j = tghash(&tokv[t][i])) == best)
+				continue;
+			list = &tgpost[tgstart[j]];
+			m = tgstart[j + 1] - tgstart[j];
+			for(lo = k = r = 0; r < rn && lo < m; r++) {
+				/* gallop, then bisect, to the first entry >= cand[r] */
+				for(step = 1, hi = lo; hi < m && list[hi] < cand[r]; step *= 2) {
+					lo = hi + 1;
+					hi = lo + step;
+				}
+				for(hi = MIN(hi, m); lo < hi; )
+					if(list[(mid = lo + (hi - lo) / 2)] < cand[r])
+						lo = mid + 1;
+					else
+						hi = mid;
+				if(lo < m && list[lo] == cand[r])
+					cand[k++] = cand[r];
+			}
+			rn = k;
+		}
+	*n = rn;
+	return True;
+}
+
 void
 usage(void) {
-	fputs("usage: dmenu [-b] [-db] [-f] [-i] [-P] [-t] [-U] [-l lines] [-p prompt] [-fn font] [-m monitor]\n"
-	      "             [-nb color] [-nf color] [-sb color] [-sf color] [-v]\n", stderr);
+	fputs("usage: dmenu [-a] [-b] [-db] [-f] [-F] [-i] [-I] [-L] [-P] [-r] [-S] [-t] [-u] [-U] [-c file] [-H file] [-l lines]\n"
+	      "             [-d delim] [-mf fields] [-df fields] [-pf fields]\n"
+	      "             [-p prompt] [-fn font] [-m monitor] [-nb color] [-nf color] [-sb color] [-sf color] [-v]\n", stderr);
 	exit(1);
 }
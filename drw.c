@@ -67,6 +67,7 @@ drw_create(Display *dpy, int screen, Window root, unsigned int w, unsigned int h
 	drw->w = w;
 	drw->h = h;
 	drw->drawable = XCreatePixmap(dpy, root, w, h, DefaultDepth(dpy, screen));
+	drw->xftdraw = XftDrawCreate(dpy, drw->drawable, DefaultVisual(dpy, screen), DefaultColormap(dpy, screen));
 	drw->gc = XCreateGC(dpy, root, 0, NULL);
 	drw->fontcount = 0;
 	XSetLineAttributes(dpy, drw->gc, 1, LineSolid, CapButt, JoinMiter);
@@ -79,9 +80,12 @@ drw_resize(Drw *drw, unsigned int w, unsigned int h) {
 		return;
 	drw->w = w;
 	drw->h = h;
+	if(drw->xftdraw)
+		XftDrawDestroy(drw->xftdraw);
 	if(drw->drawable != 0)
 		XFreePixmap(drw->dpy, drw->drawable);
 	drw->drawable = XCreatePixmap(drw->dpy, drw->root, w, h, DefaultDepth(drw->dpy, drw->screen));
+	drw->xftdraw = XftDrawCreate(drw->dpy, drw->drawable, DefaultVisual(drw->dpy, drw->screen), DefaultColormap(drw->dpy, drw->screen));
 }
 
 void
@@ -91,6 +95,9 @@ drw_free(Drw *drw) {
 	for (i = 0; i < drw->fontcount; i++) {
 		drw_font_free(drw->fonts[i]);
 	}
+	free(drw->bmpfont);
+	free(drw->astralfont);
+	XftDrawDestroy(drw->xftdraw);
 	XFreePixmap(drw->dpy, drw->drawable);
 	XFreeGC(drw->dpy, drw->gc);
 	free(drw);
@@ -215,17 +222,74 @@ drw_rect(Drw *drw, int x, int y, unsigned int w, unsigned int h, int filled, int
 		XDrawRectangle(drw->dpy, drw->drawable, drw->gc, x, y, w, h);
 }
 
+/* A codepoint's slot in the font cache. The BMP is a flat table, the
+ * rest an open hash set that is kept at most half full.
+ */
+static unsigned char *
+drw_fontslot(Drw *drw, long codepoint) {
+	FntCode *old;
+	size_t i, h, mask, n;
+
+	if (codepoint < 0x10000) {
+		if (!drw->bmpfont && !(drw->bmpfont = calloc(0x10000, 1)))
+			die("cannot malloc %u bytes:", 0x10000);
+		return &drw->bmpfont[codepoint];
+	}
+	if (2 * (drw->nastral + 1) > drw->astralcap) {
+		old = drw->astralfont;
+		n = drw->astralcap;
+		drw->astralcap = n ? n * 2 : 256;
+		if (!(drw->astralfont = calloc(drw->astralcap, sizeof *drw->astralfont)))
+			die("cannot malloc %u bytes:", drw->astralcap * sizeof *drw->astralfont);
+		for (mask = drw->astralcap - 1, i = 0; i < n; i++) {
+			if (!old[i].codepoint)
+				continue;
+			for (h = (old[i].codepoint * 2654435761UL) & mask; drw->astralfont[h].codepoint; h = (h + 1) & mask)
+				;
+			drw->astralfont[h] = old[i];
+		}
+		free(old);
+	}
+	mask = drw->astralcap - 1;
+	for (h = (codepoint * 2654435761UL) & mask; drw->astralfont[h].codepoint != codepoint; h = (h + 1) & mask) {
+		if (!drw->astralfont[h].codepoint) {
+			drw->astralfont[h].codepoint = codepoint;
+			drw->nastral++;
+			break;
+		}
+	}
+	return &drw->astralfont[h].font;
+}
+
+/* The index of the first font that has a codepoint, or -1 if none has.
+ * A slot holds the index plus one, or 0x40 and the number of fonts known
+ * not to have it, so only fallback fonts added since are tried.
+ */
+static int
+drw_fontindex(Drw *drw, long codepoint) {
+	unsigned char *slot = drw_fontslot(drw, codepoint);
+	size_t i;
+
+	if (*slot && !(*slot & 0x40))
+		return *slot - 1;
+	for (i = *slot & 0x3f; i < drw->fontcount; i++) {
+		if (XftCharExists(drw->dpy, drw->fonts[i]->xfont, codepoint)) {
+			*slot = i + 1;
+			return i;
+		}
+	}
+	*slot = 0x40 | drw->fontcount;
+	return -1;
+}
+
 int
 drw_text(Drw *drw, int x, int y, unsigned int w, unsigned int h, const char *text, int invert) {
 	char buf[1024];
 	int tx, ty, th;
-	Extnts tex;
-	Colormap cmap;
-	Visual *vis;
-	XftDraw *d;
+	Extnts tex, fit;
 	Fnt *curfont, *nextfont;
-	size_t i, len;
-	int utf8strlen, utf8charlen, render;
+	size_t i, len, lo, hi, mid;
+	int utf8strlen, utf8charlen, render, fi;
 	long utf8codepoint = 0;
 	const char *utf8str;
 	FcCharSet *fccharset;
@@ -247,10 +311,6 @@ drw_text(Drw *drw, int x, int y, unsigned int w, unsigned int h, const char *tex
 
 	if (!text || !drw->fontcount) {
 		return 0;
-	} else if (render) {
-		cmap = DefaultColormap(drw->dpy, drw->screen);
-		vis = DefaultVisual(drw->dpy, drw->screen);
-		d = XftDrawCreate(drw->dpy, drw->drawable, vis, cmap);
 	}
 
 	curfont = drw->fonts[0];
@@ -260,16 +320,15 @@ drw_text(Drw *drw, int x, int y, unsigned int w, unsigned int h, const char *tex
 		nextfont = NULL;
 		while (*text) {
 			utf8charlen = utf8decode(text, &utf8codepoint, UTF_SIZ);
-			for (i = 0; i < drw->fontcount; i++) {
-				charexists = charexists || XftCharExists(drw->dpy, drw->fonts[i]->xfont, utf8codepoint);
-				if (charexists) {
-					if (drw->fonts[i] == curfont) {
-						utf8strlen += utf8charlen;
-						text += utf8charlen;
-					} else {
-						nextfont = drw->fonts[i];
-					}
-					break;
+			/* a character no font has is drawn in the first one */
+			fi = charexists ? 0 : drw_fontindex(drw, utf8codepoint);
+			if (fi >= 0) {
+				charexists = 1;
+				if (drw->fonts[fi] == curfont) {
+					utf8strlen += utf8charlen;
+					text += utf8charlen;
+				} else {
+					nextfont = drw->fonts[fi];
 				}
 			}
 
@@ -282,21 +341,51 @@ drw_text(Drw *drw, int x, int y, unsigned int w, unsigned int h, const char *tex
 
 		if (utf8strlen) {
 			drw_font_getexts(curfont, utf8str, utf8strlen, &tex);
-			/* shorten text if necessary */
-			for(len = MIN(utf8strlen, (sizeof buf) - 1); len && (tex.w > w - drw->fonts[0]->h || w < drw->fonts[0]->h); len--)
-				drw_font_getexts(curfont, utf8str, len, &tex);
+			/* shorten text if necessary, to the most whole characters
+			 * that fit. the width only grows with the length, so they
+			 * are found by bisection.
+			 */
+			len = MIN(utf8strlen, (sizeof buf) - 1);
+			if (w < drw->fonts[0]->h) {
+				len = 0;
+			} else if (tex.w > w - drw->fonts[0]->h) {
+				for (lo = 0, hi = len + 1, tex.w = 0; hi - lo > 1; ) {
+					for (mid = lo + (hi - lo) / 2; mid > lo && (utf8str[mid] & 0xc0) == 0x80; mid--)
+						;
+					if (mid == lo)
+						for (mid = lo + 1; mid < hi && (utf8str[mid] & 0xc0) == 0x80; mid++)
+							;
+					if (mid == hi)
+						break;
+					drw_font_getexts(curfont, utf8str, mid, &fit);
+					if (fit.w > w - drw->fonts[0]->h) {
+						hi = mid;
+					} else {
+						lo = mid;
+						tex = fit;
+					}
+				}
+				len = lo;
+			}
+			for (; len && len < (size_t)utf8strlen && (utf8str[len] & 0xc0) == 0x80; len--)
+				;
 
 			if (len) {
 				memcpy(buf, utf8str, len);
 				buf[len] = '\0';
-				if(len < utf8strlen)
-					for(i = len; i && i > len - 3; buf[--i] = '.');
+				/* end in dots, in place of whole characters */
+				if (len < (size_t)utf8strlen && len >= 3) {
+					for (i = len - 3; i && (buf[i] & 0xc0) == 0x80; i--)
+						;
+					memcpy(&buf[i], "...", 3);
+					len = i + 3;
+				}
 
 				if (render) {
 					th = curfont->ascent + curfont->descent;
 					ty = y + (h / 2) - (th / 2) + curfont->ascent;
 					tx = x + (h / 2);
-					XftDrawStringUtf8(d, invert ? &drw->scheme->bg->rgb : &drw->scheme->fg->rgb, curfont->xfont, tx, ty, (XftChar8 *)buf, len);
+					XftDrawStringUtf8(drw->xftdraw, invert ? &drw->scheme->bg->rgb : &drw->scheme->fg->rgb, curfont->xfont, tx, ty, (XftChar8 *)buf, len);
 				}
 
 				x += tex.w;
@@ -354,10 +443,6 @@ drw_text(Drw *drw, int x, int y, unsigned int w, unsigned int h, const char *tex
 		}
 	}
 
-	if (render) {
-		XftDrawDestroy(d);
-	}
-
 	return x;
 }
 
@@ -19,6 +19,11 @@ typedef struct {
 	FcPattern *pattern;
 } Fnt;
 
+typedef struct {
+	long codepoint;
+	unsigned char font;
+} FntCode;
+
 typedef struct {
 	Clr *fg;
 	Clr *bg;
@@ -31,10 +36,15 @@ typedef struct {
 	int screen;
 	Window root;
 	Drawable drawable;
+	XftDraw *xftdraw;
 	GC gc;
 	ClrScheme *scheme;
 	size_t fontcount;
 	Fnt *fonts[DRW_FONT_CACHE_SIZE];
+	/* the first font with each codepoint, see drw_fontindex() */
+	unsigned char *bmpfont;
+	FntCode *astralfont;
+	size_t nastral, astralcap;
 } Drw;
 
 typedef struct {
@@ -0,0 +1,661 @@
+/* See LICENSE file for copyright and license details. */
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rx.h"
+#include "util.h"
+
+#define MAXSTATES  1024  /* per DFA; bigger automata are simulated as an NFA */
+#define TABSIZE    (2 * MAXSTATES)
+#define HASBYTE(S, C)  ((S)[(C) >> 3] & 1 << ((C) & 7))
+
+enum { Char, Split, Jmp, Bol, Eol, Match };                  /* instructions */
+enum { NSet, NCat, NAlt, NStar, NPlus, NQuest, NBol, NEol, NEmpty }; /* nodes */
+enum { AtStart = 1, AtEnd = 2 };                             /* assertions */
+enum { StMatch = 1, StMatchEnd = 2 };                        /* state flags */
+
+typedef struct {
+	int op;
+	int x, y; /* byte set of Char, targets of Split and Jmp */
+} Inst;
+
+typedef struct {
+	int type;
+	int l, r; /* children, or the byte set of NSet */
+} Node;
+
+typedef struct {
+	int *pc;
+	int n;
+} List;
+
+typedef struct {
+	int *next; /* nstates * ncls transitions, -1 where the automaton dies */
+	unsigned char *flags;
+	int nstates, cap;
+	int start;
+} Dfa;
+
+struct Rx {
+	Inst *inst;
+	int ninst, instcap;
+	unsigned char (*set)[32];
+	int nset, setcap;
+	unsigned char cls[256]; /* bytes no set tells apart share a class */
+	unsigned char rep[256]; /* a byte of each class */
+	int ncls;
+	Dfa dfa[2];             /* anchored at the start, and unanchored */
+	int usedfa;
+};
+
+typedef struct {
+	const char *p;
+	Rx *rx;
+	Node *node;
+	int nnode, nodecap;
+	int icase;
+	int err;
+} Parser;
+
+struct RxSpace {
+	List cur, next, tmp;
+	int *mark, gen;
+};
+
+typedef struct {
+	List cur, next, tmp;
+	int *mark, gen;
+	int *pool, npool, poolcap;
+	int off[MAXSTATES + 1];
+	int tab[TABSIZE];
+} Builder;
+
+static int parsealt(Parser *ps);
+
+static void
+addthread(const Rx *rx, List *l, int pc, int at, int *mark, int gen) {
+	if(mark[pc] == gen)
+		return;
+	mark[pc] = gen;
+	switch(rx->inst[pc].op) {
+	case Jmp:
+		addthread(rx, l, rx->inst[pc].x, at, mark, gen);
+		break;
+	case Split:
+		addthread(rx, l, rx->inst[pc].x, at, mark, gen);
+		addthread(rx, l, rx->inst[pc].y, at, mark, gen);
+		break;
+	case Bol:
+		if(at & AtStart)
+			addthread(rx, l, pc + 1, at, mark, gen);
+		break;
+	case Eol:
+		if(at & AtEnd)
+			addthread(rx, l, pc + 1, at, mark, gen);
+		else
+			l->pc[l->n++] = pc;
+		break;
+	default:
+		l->pc[l->n++] = pc;
+		break;
+	}
+}
+
+static int
+emit(Rx *rx, int op, int x, int y) {
+	if(rx->ninst == rx->instcap) {
+		rx->instcap = rx->instcap ? rx->instcap * 2 : 64;
+		if(!(rx->inst = realloc(rx->inst, rx->instcap * sizeof *rx->inst)))
+			die("cannot realloc %u bytes:", rx->instcap * sizeof *rx->inst);
+	}
+	rx->inst[rx->ninst].op = op;
+	rx->inst[rx->ninst].x = x;
+	rx->inst[rx->ninst].y = y;
+	return rx->ninst++;
+}
+
+static void
+compile(Rx *rx, const Node *node, int n) {
+	int a, b;
+
+	switch(node[n].type) {
+	case NSet:
+		emit(rx, Char, node[n].l, 0);
+		break;
+	case NCat:
+		compile(rx, node, node[n].l);
+		compile(rx, node, node[n].r);
+		break;
+	case NAlt:
+		a = emit(rx, Split, rx->ninst + 1, 0);
+		compile(rx, node, node[n].l);
+		b = emit(rx, Jmp, 0, 0);
+		rx->inst[a].y = rx->ninst;
+		compile(rx, node, node[n].r);
+		rx->inst[b].x = rx->ninst;
+		break;
+	case NStar:
+		a = emit(rx, Split, rx->ninst + 1, 0);
+		compile(rx, node, node[n].l);
+		emit(rx, Jmp, a, 0);
+		rx->inst[a].y = rx->ninst;
+		break;
+	case NPlus:
+		a = rx->ninst;
+		compile(rx, node, node[n].l);
+		emit(rx, Split, a, rx->ninst + 1);
+		break;
+	case NQuest:
+		a = emit(rx, Split, rx->ninst + 1, 0);
+		compile(rx, node, node[n].l);
+		rx->inst[a].y = rx->ninst;
+		break;
+	case NBol:
+		emit(rx, Bol, 0, 0);
+		break;
+	case NEol:
+		emit(rx, Eol, 0, 0);
+		break;
+	}
+}
+
+static int
+intcmp(const void *a, const void *b) {
+	return *(const int *)a - *(const int *)b;
+}
+
+static int
+listflags(const Rx *rx, const List *l, List *tmp, int *mark, int gen) {
+	int i, flags = 0;
+
+	tmp->n = 0;
+	for(i = 0; i < l->n; i++) {
+		if(rx->inst[l->pc[i]].op == Match)
+			flags |= StMatch;
+		else if(rx->inst[l->pc[i]].op == Eol)
+			addthread(rx, tmp, l->pc[i] + 1, AtEnd, mark, gen);
+	}
+	for(i = 0; i < tmp->n; i++)
+		if(rx->inst[tmp->pc[i]].op == Match)
+			flags |= StMatchEnd;
+	return flags;
+}
+
+static void
+step(const Rx *rx, const List *from, List *to, int c, int anywhere, int *mark, int gen) {
+	const Inst *in;
+	int i;
+
+	to->n = 0;
+	for(i = 0; i < from->n; i++) {
+		in = &rx->inst[from->pc[i]];
+		if(in->op == Char && HASBYTE(rx->set[in->x], c))
+			addthread(rx, to, from->pc[i] + 1, 0, mark, gen);
+	}
+	if(anywhere)
+		addthread(rx, to, 0, 0, mark, gen);
+}
+
+/* look up the DFA state for thread list l, adding it if it is new */
+static int
+intern(Rx *rx, Dfa *d, Builder *b, List *l) {
+	unsigned int h = 0, i;
+	int s, j;
+
+	if(!l->n)
+		return -1;
+	qsort(l->pc, l->n, sizeof *l->pc, intcmp);
+	for(j = 0; j < l->n; j++)
+		h = h * 31 + l->pc[j];
+	for(i = h & (TABSIZE - 1); (s = b->tab[i]) >= 0; i = (i + 1) & (TABSIZE - 1))
+		if(b->off[s + 1] - b->off[s] == l->n
+		&& !memcmp(b->pool + b->off[s], l->pc, l->n * sizeof *l->pc))
+			return s;
+	if(d->nstates == MAXSTATES)
+		return -2;
+	s = d->nstates++;
+	if(b->npool + l->n > b->poolcap) {
+		b->poolcap = MAX(b->poolcap * 2, b->npool + l->n);
+		if(!(b->pool = realloc(b->pool, b->poolcap * sizeof *b->pool)))
+			die("cannot realloc %u bytes:", b->poolcap * sizeof *b->pool);
+	}
+	memcpy(b->pool + b->npool, l->pc, l->n * sizeof *l->pc);
+	b->npool += l->n;
+	b->off[s + 1] = b->npool;
+	if(d->nstates > d->cap) {
+		d->cap = d->cap ? d->cap * 2 : 16;
+		if(!(d->next = realloc(d->next, d->cap * rx->ncls * sizeof *d->next))
+		|| !(d->flags = realloc(d->flags, d->cap)))
+			die("cannot realloc %u bytes:", d->cap * rx->ncls * sizeof *d->next);
+	}
+	d->flags[s] = listflags(rx, l, &b->tmp, b->mark, ++b->gen);
+	b->tab[i] = s;
+	return s;
+}
+
+/* build the whole DFA up front so that matching never writes to it */
+static int
+builddfa(Rx *rx, Dfa *d, int anywhere) {
+	Builder *b;
+	int s, t, k, ok = 1;
+
+	if(!(b = malloc(sizeof *b)))
+		die("cannot malloc %u bytes:", sizeof *b);
+	if(!(b->cur.pc = malloc(3 * rx->ninst * sizeof(int)))
+	|| !(b->mark = calloc(rx->ninst, sizeof(int))))
+		die("cannot malloc %u bytes:", 3 * rx->ninst * sizeof(int));
+	b->next.pc = b->cur.pc + rx->ninst;
+	b->tmp.pc = b->next.pc + rx->ninst;
+	b->gen = 0;
+	b->pool = NULL;
+	b->npool = b->poolcap = 0;
+	b->off[0] = 0;
+	memset(b->tab, -1, sizeof b->tab);
+
+	b->cur.n = 0;
+	addthread(rx, &b->cur, 0, AtStart, b->mark, ++b->gen);
+	d->start = intern(rx, d, b, &b->cur);
+	for(s = 0; s < d->nstates && ok; s++) {
+		b->cur.n = b->off[s + 1] - b->off[s];
+		memcpy(b->cur.pc, b->pool + b->off[s], b->cur.n * sizeof(int));
+		for(k = 0; k < rx->ncls; k++) {
+			step(rx, &b->cur, &b->next, rx->rep[k], anywhere, b->mark, ++b->gen);
+			if((t = intern(rx, d, b, &b->next)) == -2) {
+				ok = 0;
+				break;
+			}
+			d->next[s * rx->ncls + k] = t;
+		}
+	}
+	free(b->pool);
+	free(b->mark);
+	free(b->cur.pc);
+	free(b);
+	return ok;
+}
+
+static int
+newnode(Parser *ps, int type, int l, int r) {
+	if(ps->nnode == ps->nodecap) {
+		ps->nodecap = ps->nodecap ? ps->nodecap * 2 : 64;
+		if(!(ps->node = realloc(ps->node, ps->nodecap * sizeof *ps->node)))
+			die("cannot realloc %u bytes:", ps->nodecap * sizeof *ps->node);
+	}
+	ps->node[ps->nnode].type = type;
+	ps->node[ps->nnode].l = l;
+	ps->node[ps->nnode].r = r;
+	return ps->nnode++;
+}
+
+static int
+newset(Rx *rx) {
+	if(rx->nset == rx->setcap) {
+		rx->setcap = rx->setcap ? rx->setcap * 2 : 16;
+		if(!(rx->set = realloc(rx->set, rx->setcap * sizeof *rx->set)))
+			die("cannot realloc %u bytes:", rx->setcap * sizeof *rx->set);
+	}
+	memset(rx->set[rx->nset], 0, sizeof *rx->set);
+	return rx->nset++;
+}
+
+static void
+addrange(Parser *ps, int s, int lo, int hi) {
+	int c;
+
+	for(c = lo; c <= hi; c++) {
+		ps->rx->set[s][c >> 3] |= 1 << (c & 7);
+		if(ps->icase && BETWEEN(c | 0x20, 'a', 'z'))
+			ps->rx->set[s][(c ^ 0x20) >> 3] |= 1 << ((c ^ 0x20) & 7);
+	}
+}
+
+static int
+rangenode(Parser *ps, int lo, int hi) {
+	int s = newset(ps->rx);
+
+	addrange(ps, s, lo, hi);
+	return newnode(ps, NSet, s, 0);
+}
+
+/* any one UTF-8 encoded character outside ASCII */
+static int
+multibyte(Parser *ps) {
+	static const unsigned char lead[][2] = { { 0xc0, 0xdf }, { 0xe0, 0xef }, { 0xf0, 0xf7 } };
+	int i, k, n = -1, seq;
+
+	for(i = 0; i < 3; i++) {
+		seq = rangenode(ps, lead[i][0], lead[i][1]);
+		for(k = 0; k <= i; k++)
+			seq = newnode(ps, NCat, seq, rangenode(ps, 0x80, 0xbf));
+		n = n < 0 ? seq : newnode(ps, NAlt, n, seq);
+	}
+	return n;
+}
+
+/* one literal character, all of its bytes if it is UTF-8 encoded */
+static int
+literal(Parser *ps) {
+	int c = (unsigned char)*ps->p++, n;
+
+	n = rangenode(ps, c, c);
+	if(c >= 0xc0)
+		while((*ps->p & 0xc0) == 0x80) {
+			c = (unsigned char)*ps->p++;
+			n = newnode(ps, NCat, n, rangenode(ps, c, c));
+		}
+	return n;
+}
+
+/* the escape after a backslash, into byte set s */
+static void
+escape(Parser *ps, int s) {
+	int c = (unsigned char)*ps->p++;
+
+	switch(c) {
+	case 'd':
+		addrange(ps, s, '0', '9');
+		break;
+	case 'w':
+		addrange(ps, s, 'a', 'z');
+		addrange(ps, s, 'A', 'Z');
+		addrange(ps, s, '0', '9');
+		addrange(ps, s, '_', '_');
+		break;
+	case 's':
+		addrange(ps, s, ' ', ' ');
+		addrange(ps, s, '\t', '\t');
+		break;
+	case 't':
+		addrange(ps, s, '\t', '\t');
+		break;
+	default:
+		addrange(ps, s, c, c);
+		break;
+	}
+}
+
+static int
+parseclass(Parser *ps) {
+	int s = newset(ps->rx), n = -1, l, c, hi, neg = 0, first = 1;
+
+	if(*ps->p == '^') {
+		neg = 1;
+		ps->p++;
+	}
+	while(*ps->p && (*ps->p != ']' || first)) {
+		first = 0;
+		c = (unsigned char)*ps->p;
+		if(c >= 0x80) {
+			l = literal(ps);
+			if(!neg) /* negated classes can only leave out ASCII */
+				n = n < 0 ? l : newnode(ps, NAlt, n, l);
+			continue;
+		}
+		if(c == '\\' && ps->p[1]) {
+			ps->p++;
+			escape(ps, s);
+			continue;
+		}
+		hi = c;
+		if(ps->p[1] == '-' && ps->p[2] && ps->p[2] != ']') {
+			hi = (unsigned char)ps->p[2];
+			ps->p += 2;
+			if(hi < c || hi >= 0x80)
+				ps->err = 1;
+		}
+		ps->p++;
+		addrange(ps, s, c, MIN(hi, 0x7f));
+	}
+	if(*ps->p != ']') {
+		ps->err = 1;
+		return newnode(ps, NEmpty, 0, 0);
+	}
+	ps->p++;
+	if(neg) {
+		for(c = 0; c < 32; c++)
+			ps->rx->set[s][c] = c < 16 ? ~ps->rx->set[s][c] : 0;
+		return newnode(ps, NAlt, newnode(ps, NSet, s, 0), multibyte(ps));
+	}
+	l = newnode(ps, NSet, s, 0);
+	return n < 0 ? l : newnode(ps, NAlt, l, n);
+}
+
+static int
+parseatom(Parser *ps) {
+	int n, s;
+
+	switch(*ps->p) {
+	case '(':
+		ps->p++;
+		n = parsealt(ps);
+		if(*ps->p != ')')
+			ps->err = 1;
+		else
+			ps->p++;
+		return n;
+	case '[':
+		ps->p++;
+		return parseclass(ps);
+	case '.':
+		ps->p++;
+		return newnode(ps, NAlt, rangenode(ps, 0x00, 0x7f), multibyte(ps));
+	case '^':
+		ps->p++;
+		return newnode(ps, NBol, 0, 0);
+	case '$':
+		ps->p++;
+		return newnode(ps, NEol, 0, 0);
+	case '*':
+	case '+':
+	case '?':
+		ps->err = 1; /* nothing to repeat */
+		return newnode(ps, NEmpty, 0, 0);
+	case '\\':
+		if(!*++ps->p) {
+			ps->err = 1;
+			return newnode(ps, NEmpty, 0, 0);
+		}
+		if((unsigned char)*ps->p >= 0x80)
+			return literal(ps);
+		s = newset(ps->rx);
+		escape(ps, s);
+		return newnode(ps, NSet, s, 0);
+	default:
+		return literal(ps);
+	}
+}
+
+static int
+parserep(Parser *ps) {
+	int n = parseatom(ps);
+
+	for(;; ps->p++)
+		switch(*ps->p) {
+		case '*':
+			n = newnode(ps, NStar, n, 0);
+			break;
+		case '+':
+			n = newnode(ps, NPlus, n, 0);
+			break;
+		case '?':
+			n = newnode(ps, NQuest, n, 0);
+			break;
+		default:
+			return n;
+		}
+}
+
+static int
+parsecat(Parser *ps) {
+	int n = -1, m;
+
+	while(*ps->p && *ps->p != '|' && *ps->p != ')' && !ps->err) {
+		m = parserep(ps);
+		n = n < 0 ? m : newnode(ps, NCat, n, m);
+	}
+	return n < 0 ? newnode(ps, NEmpty, 0, 0) : n;
+}
+
+static int
+parsealt(Parser *ps) {
+	int n = parsecat(ps);
+
+	while(*ps->p == '|' && !ps->err) {
+		ps->p++;
+		n = newnode(ps, NAlt, n, parsecat(ps));
+	}
+	return n;
+}
+
+static int
+rundfa(const Rx *rx, const Dfa *d, const char *s, size_t len, int anywhere) {
+	int st = d->start, res = RxNone;
+	size_t i = 0;
+
+	for(; st >= 0; st = d->next[st * rx->ncls + rx->cls[(unsigned char)s[i++]]]) {
+		if(d->flags[st] & StMatch) {
+			if(anywhere)
+				return RxAnywhere;
+			res = RxStart;
+		}
+		if(i == len)
+			return d->flags[st] & (StMatch | StMatchEnd) ? (anywhere ? RxAnywhere : RxFull) : res;
+	}
+	return res;
+}
+
+/* the same walk as rundfa, working out each state as it goes. the
+   marks of sp are left to later calls, which go on from its gen. */
+static int
+runnfa(const Rx *rx, const char *s, size_t len, int anywhere, RxSpace *sp) {
+	List cur = sp->cur, next = sp->next, tmp = sp->tmp, t;
+	int *mark = sp->mark, flags, gen = sp->gen, res = RxNone;
+	size_t i;
+
+	/* a walk takes at most two generations a byte */
+	if((size_t)(INT_MAX - gen) < 2 * len + 3) {
+		memset(mark, 0, rx->ninst * sizeof *mark);
+		gen = 0;
+	}
+	cur.n = 0;
+	addthread(rx, &cur, 0, AtStart, mark, ++gen);
+	for(i = 0; cur.n; i++) {
+		flags = listflags(rx, &cur, &tmp, mark, ++gen);
+		if(flags & StMatch) {
+			res = anywhere ? RxAnywhere : RxStart;
+			if(anywhere)
+				break;
+		}
+		if(i == len) {
+			if(flags & (StMatch | StMatchEnd))
+				res = anywhere ? RxAnywhere : RxFull;
+			break;
+		}
+		step(rx, &cur, &next, (unsigned char)s[i], anywhere, mark, ++gen);
+		t = cur;
+		cur = next;
+		next = t;
+	}
+	sp->gen = gen;
+	return res;
+}
+
+Rx *
+rxcompile(const char *pattern, int icase) {
+	Parser ps;
+	Rx *rx;
+	int root, c, s, n, in, map[256][2];
+
+	if(!(rx = calloc(1, sizeof *rx)))
+		die("cannot malloc %u bytes:", sizeof *rx);
+	ps.p = pattern;
+	ps.rx = rx;
+	ps.node = NULL;
+	ps.nnode = ps.nodecap = 0;
+	ps.icase = icase;
+	ps.err = 0;
+	root = parsealt(&ps);
+	if(*ps.p) /* unbalanced ')' */
+		ps.err = 1;
+	if(!ps.err) {
+		compile(rx, ps.node, root);
+		emit(rx, Match, 0, 0);
+	}
+	free(ps.node);
+	if(ps.err) {
+		rxfree(rx);
+		return NULL;
+	}
+
+	/* split the bytes into classes that every set treats alike */
+	rx->ncls = 1;
+	for(s = 0; s < rx->nset; s++) {
+		memset(map, -1, sizeof map);
+		for(c = n = 0; c < 256; c++) {
+			in = HASBYTE(rx->set[s], c) != 0;
+			if(map[rx->cls[c]][in] < 0)
+				map[rx->cls[c]][in] = n++;
+			rx->cls[c] = map[rx->cls[c]][in];
+		}
+		rx->ncls = n;
+	}
+	for(c = 255; c >= 0; c--)
+		rx->rep[rx->cls[c]] = c;
+
+	rx->usedfa = builddfa(rx, &rx->dfa[0], 0) && builddfa(rx, &rx->dfa[1], 1);
+	return rx;
+}
+
+void
+rxfree(Rx *rx) {
+	if(!rx)
+		return;
+	free(rx->dfa[0].next);
+	free(rx->dfa[0].flags);
+	free(rx->dfa[1].next);
+	free(rx->dfa[1].flags);
+	free(rx->set);
+	free(rx->inst);
+	free(rx);
+}
+
+RxSpace *
+rxspace(const Rx *rx) {
+	RxSpace *sp;
+
+	/* the thread lists and marks of runnfa, which a DFA does without */
+	if(rx->usedfa)
+		return NULL;
+	if(!(sp = malloc(sizeof *sp))
+	|| !(sp->cur.pc = malloc(3 * rx->ninst * sizeof(int)))
+	|| !(sp->mark = calloc(rx->ninst, sizeof(int))))
+		die("cannot malloc %u bytes:", 3 * rx->ninst * sizeof(int));
+	sp->next.pc = sp->cur.pc + rx->ninst;
+	sp->tmp.pc = sp->next.pc + rx->ninst;
+	sp->gen = 0;
+	return sp;
+}
+
+void
+rxspacefree(RxSpace *sp) {
+	if(!sp)
+		return;
+	free(sp->cur.pc);
+	free(sp->mark);
+	free(sp);
+}
+
+int
+rxmatch(const Rx *rx, const char *s, size_t len, RxSpace *sp) {
+	int r;
+
+	if(rx->usedfa) {
+		if((r = rundfa(rx, &rx->dfa[0], s, len, 0)) != RxNone)
+			return r;
+		return rundfa(rx, &rx->dfa[1], s, len, 1);
+	}
+	if((r = runnfa(rx, s, len, 0, sp)) != RxNone)
+		return r;
+	return runnfa(rx, s, len, 1, sp);
+}
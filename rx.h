@@ -0,0 +1,16 @@
+/* See LICENSE file for copyright and license details. */
+
+/* how much of a string a pattern matches, best first */
+enum { RxFull, RxStart, RxAnywhere, RxNone };
+
+typedef struct Rx Rx;
+typedef struct RxSpace RxSpace;
+
+/* compile an extended regular expression; NULL if it is malformed */
+Rx *rxcompile(const char *pattern, int icase);
+void rxfree(Rx *rx);
+/* room for matching rx, for one thread at a time; NULL if none is needed */
+RxSpace *rxspace(const Rx *rx);
+void rxspacefree(RxSpace *sp);
+/* match s against rx in one linear pass; safe to call from threads */
+int rxmatch(const Rx *rx, const char *s, size_t len, RxSpace *sp);
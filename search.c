@@ -0,0 +1,184 @@
+/* See LICENSE file for copyright and license details. */
+#include <stddef.h>
+#include <string.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SEARCH_X86
+#include <immintrin.h>
+#endif
+
+#include "search.h"
+
+#define FOLD(c)  ((unsigned char)((c) - 'A') < 26 ? (c) | 0x20 : (c))
+
+typedef char *(*Finder)(const char *, size_t, const char *, size_t);
+
+static char *memfind_scalar(const char *h, size_t hlen, const char *n, size_t nlen);
+static char *memifind_scalar(const char *h, size_t hlen, const char *n, size_t nlen);
+
+static Finder finder = memfind_scalar;
+static Finder ifinder = memifind_scalar;
+
+static int
+memicmp(const char *a, const char *b, size_t len) {
+	size_t i;
+
+	for(i = 0; i < len; i++)
+		if(FOLD((unsigned char)a[i]) != FOLD((unsigned char)b[i]))
+			return 1;
+	return 0;
+}
+
+static int
+verify(const char *a, const char *b, size_t len, int fold) {
+	return fold ? memicmp(a, b, len) : memcmp(a, b, len);
+}
+
+/* scalar versions, also used for the tail of the vector versions */
+static char *
+memfind_scalar(const char *h, size_t hlen, const char *n, size_t nlen) {
+	const char *p, *end;
+
+	if(nlen > hlen)
+		return NULL;
+	for(p = h, end = h + hlen - nlen + 1; (p = memchr(p, n[0], end - p)); p++)
+		if(!memcmp(p + 1, n + 1, nlen - 1))
+			return (char *)p;
+	return NULL;
+}
+
+static char *
+memifind_scalar(const char *h, size_t hlen, const char *n, size_t nlen) {
+	size_t i;
+	unsigned char c = FOLD((unsigned char)n[0]);
+
+	if(nlen > hlen)
+		return NULL;
+	for(i = 0; i <= hlen - nlen; i++)
+		if(FOLD((unsigned char)h[i]) == c && !memicmp(h + i + 1, n + 1, nlen - 1))
+			return (char *)h + i;
+	return NULL;
+}
+
+#ifdef SEARCH_X86
+/*
+ * The vector versions compare a block of candidate positions against
+ * both the first and the last byte of the needle at once and only
+ * verify positions where both agree. Loads never go past h + hlen.
+ */
+__attribute__((target("sse2"))) static __m128i
+fold128(__m128i v) {
+	__m128i upper = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('A' - 1)),
+	                              _mm_cmplt_epi8(v, _mm_set1_epi8('Z' + 1)));
+
+	return _mm_or_si128(v, _mm_and_si128(upper, _mm_set1_epi8(0x20)));
+}
+
+__attribute__((target("sse2"))) static char *
+find_sse2(const char *h, size_t hlen, const char *n, size_t nlen, int fold) {
+	__m128i first, last, a, b;
+	unsigned int mask;
+	size_t i;
+
+	if(nlen > hlen)
+		return NULL;
+	first = _mm_set1_epi8(fold ? FOLD((unsigned char)n[0]) : n[0]);
+	last = _mm_set1_epi8(fold ? FOLD((unsigned char)n[nlen - 1]) : n[nlen - 1]);
+	for(i = 0; i + nlen - 1 + 16 <= hlen; i += 16) {
+		a = _mm_loadu_si128((const __m128i *)(h + i));
+		b = _mm_loadu_si128((const __m128i *)(h + i + nlen - 1));
+		if(fold) {
+			a = fold128(a);
+			b = fold128(b);
+		}
+		mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first),
+		                                       _mm_cmpeq_epi8(b, last)));
+		for(; mask; mask &= mask - 1)
+			if(!verify(h + i + __builtin_ctz(mask) + 1, n + 1, nlen - 1, fold))
+				return (char *)h + i + __builtin_ctz(mask);
+	}
+	return (fold ? memifind_scalar : memfind_scalar)(h + i, hlen - i, n, nlen);
+}
+
+static char *
+memfind_sse2(const char *h, size_t hlen, const char *n, size_t nlen) {
+	return find_sse2(h, hlen, n, nlen, 0);
+}
+
+static char *
+memifind_sse2(const char *h, size_t hlen, const char *n, size_t nlen) {
+	return find_sse2(h, hlen, n, nlen, 1);
+}
+
+__attribute__((target("avx2"))) static __m256i
+fold256(__m256i v) {
+	__m256i upper = _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8('A' - 1)),
+	                                 _mm256_cmpgt_epi8(_mm256_set1_epi8('Z' + 1), v));
+
+	return _mm256_or_si256(v, _mm256_and_si256(upper, _mm256_set1_epi8(0x20)));
+}
+
+__attribute__((target("avx2"))) static char *
+find_avx2(const char *h, size_t hlen, const char *n, size_t nlen, int fold) {
+	__m256i first, last, a, b;
+	unsigned int mask;
+	size_t i;
+
+	if(nlen > hlen)
+		return NULL;
+	first = _mm256_set1_epi8(fold ? FOLD((unsigned char)n[0]) : n[0]);
+	last = _mm256_set1_epi8(fold ? FOLD((unsigned char)n[nlen - 1]) : n[nlen - 1]);
+	for(i = 0; i + nlen - 1 + 32 <= hlen; i += 32) {
+		a = _mm256_loadu_si256((const __m256i *)(h + i));
+		b = _mm256_loadu_si256((const __m256i *)(h + i + nlen - 1));
+		if(fold) {
+			a = fold256(a);
+			b = fold256(b);
+		}
+		mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, first),
+		                                             _mm256_cmpeq_epi8(b, last)));
+		for(; mask; mask &= mask - 1)
+			if(!verify(h + i + __builtin_ctz(mask) + 1, n + 1, nlen - 1, fold))
+				return (char *)h + i + __builtin_ctz(mask);
+	}
+	return find_sse2(h + i, hlen - i, n, nlen, fold);
+}
+
+static char *
+memfind_avx2(const char *h, size_t hlen, const char *n, size_t nlen) {
+	return find_avx2(h, hlen, n, nlen, 0);
+}
+
+static char *
+memifind_avx2(const char *h, size_t hlen, const char *n, size_t nlen) {
+	return find_avx2(h, hlen, n, nlen, 1);
+}
+#endif
+
+void
+searchinit(void) {
+#ifdef SEARCH_X86
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2")) {
+		finder = memfind_avx2;
+		ifinder = memifind_avx2;
+	}
+	else if(__builtin_cpu_supports("sse2")) {
+		finder = memfind_sse2;
+		ifinder = memifind_sse2;
+	}
+#endif
+}
+
+char *
+memfind(const char *h, size_t hlen, const char *n, size_t nlen) {
+	if(!nlen)
+		return (char *)h;
+	return finder(h, hlen, n, nlen);
+}
+
+char *
+memifind(const char *h, size_t hlen, const char *n, size_t nlen) {
+	if(!nlen)
+		return (char *)h;
+	return ifinder(h, hlen, n, nlen);
+}
@@ -0,0 +1,8 @@
+/* See LICENSE file for copyright and license details. */
+
+/* find needle n in haystack h; memifind ignores ASCII case */
+char *memfind(const char *h, size_t hlen, const char *n, size_t nlen);
+char *memifind(const char *h, size_t hlen, const char *n, size_t nlen);
+
+/* pick the fastest versions for this CPU; call before any threads start */
+void searchinit(void);